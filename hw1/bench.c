@@ -0,0 +1,548 @@
+/*
+ * Benchmarks for the page table variants. Built as a separate executable
+ * against the same sources as the tests:
+ *
+ *	hw1_bench [name...]
+ *
+ * runs the named benchmarks, or all of them.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "os.h"
+#include "numa.h"
+#include "ptl.h"
+#include "util.h"
+#include "vm.h"
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* --- locking strategies --- */
+
+#define PTL_OPS		(1 << 20)
+#define PTL_SPAN	(64 * 512)	/* pages per region: 64 leaf tables */
+#define PTL_MAX_THREADS	8
+
+struct ptl_worker {
+	pthread_t thread;
+	enum ptl_mode mode;
+	uint64_t pt;
+	uint64_t base;		/* first vpn of the region this thread works in */
+	unsigned int update_pct;
+	uint64_t seed;
+	pthread_barrier_t *start;
+};
+
+static void *ptl_worker_run(void *arg)
+{
+	struct ptl_worker *w = arg;
+	uint64_t sink = 0;
+
+	pthread_barrier_wait(w->start);
+	for (int i = 0; i < PTL_OPS; i++) {
+		uint64_t r = xorshift(&w->seed);
+		uint64_t vpn = w->base + (r >> 8) % PTL_SPAN;
+
+		if (r % 100 < w->update_pct)
+			ptl_update(w->mode, w->pt, vpn, r & 1 ? NO_MAPPING : vpn);
+		else
+			sink += ptl_query(w->mode, w->pt, vpn);
+	}
+	return (void *)(uintptr_t)sink;
+}
+
+/* Mops/s with nthreads threads, each in its own region or all in one */
+static double ptl_run(enum ptl_mode mode, int nthreads, int local, unsigned int update_pct)
+{
+	struct ptl_worker workers[PTL_MAX_THREADS];
+	pthread_barrier_t start;
+	uint64_t pt = alloc_page_frame();
+	double begin, elapsed;
+
+	/* populate every region up front so tables already exist */
+	for (int t = 0; t < nthreads; t++)
+		for (uint64_t vpn = 0; vpn < PTL_SPAN; vpn++)
+			ptl_update(mode, pt, ((uint64_t)t << 27) + vpn, vpn);
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (int t = 0; t < nthreads; t++) {
+		workers[t] = (struct ptl_worker){
+			.mode = mode,
+			.pt = pt,
+			.base = local ? (uint64_t)t << 27 : 0,
+			.update_pct = update_pct,
+			.seed = 0x9e3779b97f4a7c15ULL * (t + 1),
+			.start = &start,
+		};
+		if (pthread_create(&workers[t].thread, NULL, ptl_worker_run, &workers[t]) != 0)
+			errx(1, "pthread_create failed");
+	}
+
+	pthread_barrier_wait(&start);
+	begin = now();
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(workers[t].thread, NULL);
+	elapsed = now() - begin;
+
+	pthread_barrier_destroy(&start);
+	page_table_destroy(pt);
+	return (double)nthreads * PTL_OPS / elapsed / 1e6;
+}
+
+static void bench_ptl(void)
+{
+	static const char *const names[] = { "global", "cas", "split" };
+	static const unsigned int update_pcts[] = { 10, 50 };
+
+	printf("ptl: Mops/s, %d ops per thread\n", PTL_OPS);
+	printf("%-8s %-7s %-8s %8s %8s %8s %8s\n",
+	       "updates", "regions", "mode", "1", "2", "4", "8");
+	for (size_t u = 0; u < sizeof(update_pcts) / sizeof(update_pcts[0]); u++) {
+		for (int local = 1; local >= 0; local--) {
+			for (int mode = PTL_GLOBAL; mode <= PTL_SPLIT; mode++) {
+				printf("%6u%%  %-7s %-8s", update_pcts[u],
+				       local ? "own" : "shared", names[mode]);
+				for (int nthreads = 1; nthreads <= PTL_MAX_THREADS; nthreads *= 2)
+					printf(" %8.2f", ptl_run(mode, nthreads, local, update_pcts[u]));
+				printf("\n");
+			}
+		}
+	}
+}
+
+/* --- per-node replication --- */
+
+#define NUMA_OPS	(1 << 19)
+#define NUMA_SPAN	(16 * 512)
+#define NUMA_NODES	2
+#define NUMA_THREADS	4	/* spread over the nodes */
+
+struct numa_worker {
+	pthread_t thread;
+	struct numa_pt *npt;
+	unsigned int node;
+	uint64_t seed;
+	pthread_barrier_t *start;
+};
+
+/* translation threads: mostly queries, an update now and then */
+static void *numa_worker_run(void *arg)
+{
+	struct numa_worker *w = arg;
+	uint64_t sink = 0;
+
+	pthread_barrier_wait(w->start);
+	for (int i = 0; i < NUMA_OPS; i++) {
+		uint64_t r = xorshift(&w->seed);
+		uint64_t vpn = (r >> 8) % NUMA_SPAN;
+
+		if (r % 1000 == 0)
+			numa_pt_update(w->npt, w->node, vpn, vpn + 1);
+		else
+			sink += numa_pt_query(w->npt, w->node, vpn);
+	}
+	return (void *)(uintptr_t)sink;
+}
+
+static void bench_numa(void)
+{
+	static struct numa_pt npt;
+
+	printf("numa: %d nodes, %d threads, %d ops per thread, 0.1%% updates\n",
+	       NUMA_NODES, NUMA_THREADS, NUMA_OPS);
+	printf("%-10s %8s %10s %10s\n", "replicas", "Mops/s", "local", "remote");
+	for (int replicate = 0; replicate <= 1; replicate++) {
+		struct numa_worker workers[NUMA_THREADS];
+		uint64_t local = 0, remote = 0;
+		pthread_barrier_t start;
+		double begin, elapsed;
+
+		numa_pt_init(&npt, NUMA_NODES, replicate);
+		for (uint64_t vpn = 0; vpn < NUMA_SPAN; vpn++)
+			numa_pt_update(&npt, NUMA_HOME_NODE, vpn, vpn);
+
+		pthread_barrier_init(&start, NULL, NUMA_THREADS + 1);
+		for (int t = 0; t < NUMA_THREADS; t++) {
+			workers[t] = (struct numa_worker){
+				.npt = &npt,
+				.node = t % NUMA_NODES,
+				.seed = 0x9e3779b97f4a7c15ULL * (t + 1),
+				.start = &start,
+			};
+			if (pthread_create(&workers[t].thread, NULL, numa_worker_run, &workers[t]) != 0)
+				errx(1, "pthread_create failed");
+		}
+
+		pthread_barrier_wait(&start);
+		begin = now();
+		for (int t = 0; t < NUMA_THREADS; t++)
+			pthread_join(workers[t].thread, NULL);
+		elapsed = now() - begin;
+		pthread_barrier_destroy(&start);
+
+		for (int n = 0; n < NUMA_NODES; n++) {
+			local += npt.replicas[n].local_refs;
+			remote += npt.replicas[n].remote_refs;
+		}
+		printf("%-10s %8.2f %10llu %10llu\n", replicate ? "per node" : "home only",
+		       (double)NUMA_THREADS * NUMA_OPS / elapsed / 1e6,
+		       (unsigned long long)local, (unsigned long long)remote);
+		numa_pt_destroy(&npt);
+	}
+}
+
+/* --- context switches --- */
+
+#define CTX_OPS		(1 << 21)
+#define CTX_SLICE	4096	/* translations between switches */
+#define CTX_WINDOW	256	/* translations that count as right after one */
+#define CTX_SPAN	(8 * 512)
+#define CTX_HOT		32	/* pages CTX_HOT_PCT of the translations go to */
+#define CTX_HOT_PCT	98
+#define CTX_MAX_ROOTS	64
+#define CTX_CACHE_BITS	8	/* as many entries as the vm.c TLB */
+#define CTX_CACHE_ENTRIES	(1 << CTX_CACHE_BITS)
+
+enum ctx_cache { CTX_NONE, CTX_FLUSH, CTX_ASID };
+
+/* a cached page_table_query result, tagged with the root it came from */
+struct ctx_entry {
+	uint64_t vpn;		/* NO_MAPPING when empty */
+	uint64_t ppn;
+	unsigned int asid;
+};
+
+struct ctx_stats {
+	uint64_t hits;
+	uint64_t window_hits;	/* hits among the first CTX_WINDOW after a switch */
+	uint64_t sink;
+};
+
+static void ctx_flush(struct ctx_entry *cache)
+{
+	for (int i = 0; i < CTX_CACHE_ENTRIES; i++)
+		cache[i].vpn = NO_MAPPING;
+}
+
+static uint64_t ctx_translate(struct ctx_entry *cache, uint64_t pt, unsigned int asid,
+			      uint64_t vpn, int *hit)
+{
+	/* the asid is mixed into the index so processes don't all collide */
+	struct ctx_entry *e = &cache[(vpn ^ asid * 0x9d) & (CTX_CACHE_ENTRIES - 1)];
+
+	*hit = e->vpn == vpn && e->asid == asid;
+	if (!*hit) {
+		e->vpn = vpn;
+		e->asid = asid;
+		e->ppn = page_table_query(pt, vpn);
+	}
+	return e->ppn;
+}
+
+/* round robin over the roots, each with the same layout and its own frames */
+static double ctx_run(const uint64_t *roots, int nroots, enum ctx_cache mode,
+		      struct ctx_stats *stats)
+{
+	static struct ctx_entry cache[CTX_CACHE_ENTRIES];
+	uint64_t seeds[CTX_MAX_ROOTS];
+	double begin;
+
+	for (int r = 0; r < nroots; r++)
+		seeds[r] = 0x9e3779b97f4a7c15ULL * (r + 1);
+	ctx_flush(cache);
+	*stats = (struct ctx_stats){ 0 };
+
+	begin = now();
+	for (int op = 0, r = 0; op < CTX_OPS; r = (r + 1) % nroots) {
+		/* a flush-on-switch TLB has one address space, asid 0 */
+		unsigned int asid = mode == CTX_ASID ? r : 0;
+
+		if (mode == CTX_FLUSH)
+			ctx_flush(cache);
+		for (int i = 0; i < CTX_SLICE; i++, op++) {
+			uint64_t x = xorshift(&seeds[r]);
+			uint64_t vpn = (x >> 8) % (x % 100 < CTX_HOT_PCT ? CTX_HOT : CTX_SPAN);
+			int hit = 0;
+
+			if (mode == CTX_NONE)
+				stats->sink += page_table_query(roots[r], vpn);
+			else
+				stats->sink += ctx_translate(cache, roots[r], asid, vpn, &hit);
+			stats->hits += hit;
+			if (i < CTX_WINDOW)
+				stats->window_hits += hit;
+		}
+	}
+	return CTX_OPS / (now() - begin) / 1e6;
+}
+
+static void bench_ctx(void)
+{
+	static const char *const names[] = { "none", "flush", "asid" };
+	static const int nroots[] = { 2, 4, 16, CTX_MAX_ROOTS };
+	uint64_t roots[CTX_MAX_ROOTS];
+
+	for (int r = 0; r < CTX_MAX_ROOTS; r++) {
+		roots[r] = alloc_page_frame();
+		for (uint64_t vpn = 0; vpn < CTX_SPAN; vpn++)
+			page_table_update(roots[r], vpn, ((uint64_t)r << 20) + vpn);
+	}
+
+	printf("ctx: %d translations, a switch every %d, %d-entry cache, %d%% to %d hot pages\n",
+	       CTX_OPS, CTX_SLICE, CTX_CACHE_ENTRIES, CTX_HOT_PCT, CTX_HOT);
+	printf("%-6s %-6s %8s %8s %14s\n", "roots", "cache", "Mops/s", "hits", "after switch");
+	for (size_t n = 0; n < sizeof(nroots) / sizeof(nroots[0]); n++) {
+		uint64_t sink = 0;
+
+		for (int mode = CTX_NONE; mode <= CTX_ASID; mode++) {
+			struct ctx_stats stats;
+			uint64_t switches = CTX_OPS / CTX_SLICE;
+			double mops = ctx_run(roots, nroots[n], mode, &stats);
+
+			if (mode == CTX_NONE)
+				sink = stats.sink;
+			else if (stats.sink != sink)
+				errx(1, "ctx: cached translations differ from the page table");
+			printf("%-6d %-6s %8.2f %7.1f%% %13.1f%%\n", nroots[n], names[mode], mops,
+			       100.0 * stats.hits / CTX_OPS,
+			       100.0 * stats.window_hits / (switches * CTX_WINDOW));
+		}
+	}
+
+	for (int r = 0; r < CTX_MAX_ROOTS; r++)
+		page_table_destroy(roots[r]);
+}
+
+/* --- table compaction --- */
+
+#define COMPACT_LEAVES	8192	/* leaf tables, 32 MiB of them */
+#define COMPACT_SPAN	((uint64_t)COMPACT_LEAVES * 512)
+#define COMPACT_QUERIES	(1 << 22)
+
+static int count_entry(uint64_t vpn, uint64_t *pte, void *arg)
+{
+	(void)vpn;
+	(void)pte;
+	(*(uint64_t *)arg)++;
+	return 0;
+}
+
+/* user-space read misses of one hardware cache, -1 where perf events are not available */
+static int miss_counter_open(uint64_t cache)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void miss_counter_start(int fd)
+{
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/* misses per operation since miss_counter_start, negative if not counted */
+static double miss_counter_stop(int fd, uint64_t ops)
+{
+	uint64_t misses;
+
+	if (fd < 0)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+		return -1;
+	return (double)misses / ops;
+}
+
+static void print_misses(double per_op)
+{
+	if (per_op < 0)
+		printf(" %12s", "n/a");
+	else
+		printf(" %12.3f", per_op);
+}
+
+/*
+ * Random queries, one query per leaf table in vpn order, and a full walk;
+ * M per second. The in-order queries also count dTLB and last-level cache
+ * misses per query, since compaction is meant to cut those.
+ */
+static void compact_measure(uint64_t pt, const char *layout)
+{
+	uint64_t seed = 0x9e3779b97f4a7c15ULL, sink = 0, entries = 0;
+	int dtlb = miss_counter_open(PERF_COUNT_HW_CACHE_DTLB);
+	int llc = miss_counter_open(PERF_COUNT_HW_CACHE_LL);
+	double begin, random, stride, scan, dtlb_misses, llc_misses;
+
+	begin = now();
+	for (int i = 0; i < COMPACT_QUERIES; i++)
+		sink += page_table_query(pt, (xorshift(&seed) >> 8) % COMPACT_SPAN);
+	random = COMPACT_QUERIES / (now() - begin) / 1e6;
+
+	miss_counter_start(dtlb);
+	miss_counter_start(llc);
+	begin = now();
+	for (int i = 0; i < COMPACT_QUERIES; i++)
+		sink += page_table_query(pt, (uint64_t)i * 512 % COMPACT_SPAN + i / COMPACT_LEAVES % 512);
+	stride = COMPACT_QUERIES / (now() - begin) / 1e6;
+	dtlb_misses = miss_counter_stop(dtlb, COMPACT_QUERIES);
+	llc_misses = miss_counter_stop(llc, COMPACT_QUERIES);
+
+	begin = now();
+	page_table_walk(pt, 0, COMPACT_SPAN, count_entry, &entries);
+	scan = entries / (now() - begin) / 1e6;
+
+	if (entries != COMPACT_SPAN || sink == 0)
+		errx(1, "compact: mappings changed");
+	printf("%-10s %12.2f %12.2f %12.2f", layout, random, stride, scan);
+	print_misses(dtlb_misses);
+	print_misses(llc_misses);
+	printf("\n");
+	if (dtlb >= 0)
+		close(dtlb);
+	if (llc >= 0)
+		close(llc);
+}
+
+static void bench_compact(void)
+{
+	static uint32_t order[COMPACT_LEAVES];
+	uint64_t pt = alloc_page_frame(), other = alloc_page_frame();
+	uint64_t seed = 1, moved;
+	double begin;
+
+	/* fill leaf tables in random order, in turn with another root */
+	for (uint32_t i = 0; i < COMPACT_LEAVES; i++)
+		order[i] = i;
+	for (uint32_t i = COMPACT_LEAVES - 1; i > 0; i--) {
+		uint32_t j = xorshift(&seed) % (i + 1), t = order[i];
+
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (uint32_t i = 0; i < COMPACT_LEAVES; i++) {
+		for (uint64_t vpn = (uint64_t)order[i] * 512; vpn < (order[i] + 1ULL) * 512; vpn++) {
+			page_table_update(pt, vpn, vpn + 1);
+			page_table_update(other, vpn, vpn + 1);
+		}
+	}
+	page_table_destroy(other);
+
+	printf("compact: %d leaf tables filled in random order, %d queries a pattern\n",
+	       COMPACT_LEAVES, COMPACT_QUERIES);
+	printf("%-10s %12s %12s %12s %12s %12s\n", "layout", "random M/s", "in order M/s",
+	       "walk Mpte/s", "dTLB miss/q", "LLC miss/q");
+	compact_measure(pt, "scattered");
+
+	begin = now();
+	moved = page_table_compact(pt);
+	printf("(compaction moved %llu tables in %.1f ms)\n", (unsigned long long)moved,
+	       (now() - begin) * 1e3);
+	compact_measure(pt, "compacted");
+
+	page_table_destroy(pt);
+}
+
+/* --- fork and exit --- */
+
+#define FORK_ROUNDS	16
+#define FORK_MAX_PAGES	(64 * 512)
+
+/* fork, write to one page in touch_every, exit: microseconds for each step */
+static void fork_run(uint64_t pt, uint64_t pages, uint64_t touch_every)
+{
+	double fork_us = 0, touch_us = 0, exit_us = 0;
+	unsigned char byte = 1;
+
+	for (int r = 0; r < FORK_ROUNDS; r++) {
+		double t0 = now(), t1, t2;
+		uint64_t child = page_table_fork(pt);
+
+		t1 = now();
+		for (uint64_t vpn = 0; vpn < pages; vpn += touch_every)
+			if (vm_write(child, vpn << 12, &byte, 1) != 0)
+				errx(1, "fork: write to vpn %llu faulted", (unsigned long long)vpn);
+		t2 = now();
+		page_table_release(child);
+		fork_us += t1 - t0;
+		touch_us += t2 - t1;
+		exit_us += now() - t2;
+	}
+
+	printf("%8llu %8llu%% %10.1f %10.1f %10.1f\n", (unsigned long long)pages,
+	       (unsigned long long)(100 / touch_every), fork_us / FORK_ROUNDS * 1e6,
+	       touch_us / FORK_ROUNDS * 1e6, exit_us / FORK_ROUNDS * 1e6);
+}
+
+static void bench_fork(void)
+{
+	static const uint64_t touch_every[] = { 100, 10, 1 };
+
+	printf("fork: clone a populated root, write to some pages, release it; %d rounds\n",
+	       FORK_ROUNDS);
+	printf("%8s %9s %10s %10s %10s\n", "pages", "written", "fork us", "write us", "exit us");
+	for (uint64_t pages = 512; pages <= FORK_MAX_PAGES; pages *= 8) {
+		uint64_t pt = alloc_page_frame();
+
+		for (uint64_t vpn = 0; vpn < pages; vpn++)
+			page_table_update(pt, vpn, alloc_page_frame());
+		for (size_t t = 0; t < sizeof(touch_every) / sizeof(touch_every[0]); t++)
+			fork_run(pt, pages, touch_every[t]);
+		page_table_release(pt);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "ptl", bench_ptl },
+	{ "numa", bench_numa },
+	{ "ctx", bench_ctx },
+	{ "compact", bench_compact },
+	{ "fork", bench_fork },
+};
+
+#define NBENCHMARKS	(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv)
+{
+	for (size_t i = 0; i < NBENCHMARKS; i++) {
+		int selected = argc < 2;
+
+		for (int j = 1; j < argc; j++)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				selected = 1;
+		if (selected)
+			benchmarks[i].run();
+	}
+
+	return 0;
+}
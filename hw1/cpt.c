@@ -0,0 +1,387 @@
+#include "os.h"
+#include "cpt.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Entries above the leaf level are either empty, a table pointer (low bits 01) or a
+// pointer to a compressed node (low bits 11). Nodes are 16-byte aligned inside a frame.
+#define VALID_BIT 1
+#define NODE_BIT 2
+#define NODES_PER_FRAME (4096 / sizeof(struct cpt_node))
+#define VPN_MASK ((1ULL << 45) - 1)
+
+struct cpt_node {
+    uint64_t key;   // vpn bits of levels 0..depth-1, shifted left by 3, then depth
+    uint64_t entry; // table pointer for the table at 'depth', or the PTE if depth is 5
+};
+
+struct cpt_path {
+    uint64_t* table;
+    uint64_t table_entry;
+    int level;
+    uint64_t* parent_slot;
+};
+
+// Nodes of every compressed root are carved from a shared pool of frames. The first slots
+// of each pool frame hold this header; a frame goes back to the allocator with its last node.
+struct cpt_pool_frame {
+    uint64_t next;  // pool frames with free nodes, by frame number, 0 at the end
+    uint64_t prev;
+    uint64_t free;  // address of the first free node in the frame, 0 if none
+    uint64_t used;
+};
+
+#define POOL_HEADER_NODES ((sizeof(struct cpt_pool_frame) + sizeof(struct cpt_node) - 1) / sizeof(struct cpt_node))
+
+static uint64_t partial_frames; // first pool frame with free nodes, 0 if none
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int entry_is_node(uint64_t entry){
+    return (entry & (VALID_BIT | NODE_BIT)) == (VALID_BIT | NODE_BIT);
+}
+
+static uint64_t index_at(uint64_t vpn, int level){
+    return (vpn >> (36 - (9 * level))) & 0x1FF;
+}
+
+static struct cpt_node* node_at(uint64_t entry){
+    struct cpt_node* node = (struct cpt_node*)(phys_to_virt(entry & ~0xFULL));
+    if (node == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+    return node;
+}
+
+static int node_depth(const struct cpt_node* node){
+    return node->key & 7;
+}
+
+static int node_matches(const struct cpt_node* node, uint64_t vpn){
+    return (vpn >> (9 * (5 - node_depth(node)))) == (node->key >> 3);
+}
+
+static uint64_t alloc_table(void){
+    return (alloc_page_frame() << 12) | VALID_BIT;
+}
+
+static struct cpt_pool_frame* pool_frame_at(uint64_t frame){
+    return (struct cpt_pool_frame*)frame_at(frame);
+}
+
+static void pool_unlink(uint64_t frame){
+    struct cpt_pool_frame* header = pool_frame_at(frame);
+
+    if (header->prev != 0) {
+        pool_frame_at(header->prev)->next = header->next;
+    } else {
+        partial_frames = header->next;
+    }
+    if (header->next != 0) {
+        pool_frame_at(header->next)->prev = header->prev;
+    }
+}
+
+static void pool_push(uint64_t frame){
+    struct cpt_pool_frame* header = pool_frame_at(frame);
+
+    header->prev = 0;
+    header->next = partial_frames;
+    if (partial_frames != 0) {
+        pool_frame_at(partial_frames)->prev = frame;
+    }
+    partial_frames = frame;
+}
+
+// Returns the entry value referring to a new node.
+static uint64_t alloc_node(uint64_t prefix, int depth, uint64_t entry){
+    struct cpt_pool_frame* header;
+    uint64_t address;
+    struct cpt_node* node;
+
+    pthread_mutex_lock(&pool_lock);
+    if (partial_frames == 0) {
+        uint64_t frame = alloc_page_frame();
+
+        header = pool_frame_at(frame);
+        for (size_t i = NODES_PER_FRAME; i-- > POOL_HEADER_NODES;) {
+            node = node_at((frame << 12) + i * sizeof(struct cpt_node));
+            node->key = header->free;
+            header->free = (frame << 12) + i * sizeof(struct cpt_node);
+        }
+        pool_push(frame);
+    }
+
+    header = pool_frame_at(partial_frames);
+    address = header->free;
+    node = node_at(address);
+    header->free = node->key;
+    header->used++;
+    if (header->free == 0) {
+        pool_unlink(partial_frames);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    node->key = (prefix << 3) | depth;
+    node->entry = entry;
+    return address | NODE_BIT | VALID_BIT;
+}
+
+static void free_node(uint64_t entry){
+    uint64_t frame = entry >> 12;
+    struct cpt_pool_frame* header = pool_frame_at(frame);
+    struct cpt_node* node = node_at(entry);
+
+    pthread_mutex_lock(&pool_lock);
+    if (header->free == 0) {
+        pool_push(frame);
+    }
+    node->key = header->free;
+    node->entry = 0;
+    header->free = entry & ~0xFULL;
+    if (--header->used == 0) {
+        pool_unlink(frame);
+        free_page_frame(frame);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+uint64_t cpt_query(uint64_t pt, uint64_t vpn){
+    uint64_t* table = table_at(pt);
+    uint64_t current_entry;
+    int level = 0;
+
+    vpn &= VPN_MASK;
+
+    while (level < 4) {
+        current_entry = table[index_at(vpn, level)];
+        if (!entry_present(current_entry)) {
+            return NO_MAPPING;
+        }
+
+        if (entry_is_node(current_entry)) {
+            struct cpt_node* node = node_at(current_entry);
+            if (!node_matches(node, vpn)) {
+                return NO_MAPPING;
+            }
+
+            // Jump straight past the levels the node stands in for.
+            level = node_depth(node);
+            if (level == 5) {
+                current_entry = node->entry;
+                goto leaf;
+            }
+            table = table_at(node->entry >> 12);
+        } else {
+            table = table_at(current_entry >> 12);
+            level++;
+        }
+    }
+
+    current_entry = table[index_at(vpn, 4)];
+leaf:
+    if (!entry_present(current_entry)) {
+        return NO_MAPPING;
+    }
+    return current_entry >> 12;
+}
+
+static void cpt_map(uint64_t* table, uint64_t vpn, uint64_t pte){
+    int level = 0;
+
+    for (;;) {
+        uint64_t* slot = &table[index_at(vpn, level)];
+        uint64_t current_entry = *slot;
+
+        if (level == 4) {
+            *slot = pte;
+            return;
+        }
+
+        if (!entry_present(current_entry)) {
+            // Nothing below: the whole remaining path becomes one node.
+            *slot = alloc_node(vpn, 5, pte);
+            return;
+        }
+
+        if (!entry_is_node(current_entry)) {
+            table = table_at(current_entry >> 12);
+            level++;
+            continue;
+        }
+
+        struct cpt_node* node = node_at(current_entry);
+        int depth = node_depth(node);
+        if (node_matches(node, vpn)) {
+            if (depth == 5) {
+                node->entry = pte;
+                return;
+            }
+            table = table_at(node->entry >> 12);
+            level = depth;
+            continue;
+        }
+
+        // The vpn leaves the node's prefix at some skipped level: expand a real table there
+        // holding both the old node and the new mapping.
+        uint64_t node_prefix = node->key >> 3;
+        int split = level + 1;
+        while (index_at(vpn, split) == ((node_prefix >> (9 * (depth - 1 - split))) & 0x1FF)) {
+            split++;
+        }
+
+        uint64_t new_table_entry = alloc_table();
+        uint64_t* new_table = table_at(new_table_entry >> 12);
+        uint64_t old_index = (node_prefix >> (9 * (depth - 1 - split))) & 0x1FF;
+
+        if (depth == split + 1) {
+            new_table[old_index] = node->entry;
+            free_node(current_entry);
+        } else {
+            new_table[old_index] = current_entry;
+        }
+
+        if (split == 4) {
+            new_table[index_at(vpn, 4)] = pte;
+        } else {
+            new_table[index_at(vpn, split)] = alloc_node(vpn, 5, pte);
+        }
+
+        if (split == level + 1) {
+            *slot = new_table_entry;
+        } else {
+            *slot = alloc_node(vpn >> (9 * (5 - split)), split, new_table_entry);
+        }
+        return;
+    }
+}
+
+// Frees emptied tables and folds tables left with one entry back into a node, from the
+// bottom of the path upward. The root table always stays.
+static void cpt_collapse(struct cpt_path* path, int depth, uint64_t vpn){
+    for (int i = depth - 1; i > 0; i--) {
+        uint64_t* table = path[i].table;
+        int level = path[i].level;
+        int count = 0;
+        int last = 0;
+
+        for (int j = 0; j < 512 && count < 2; j++) {
+            if (entry_present(table[j])) {
+                count++;
+                last = j;
+            }
+        }
+
+        if (count > 1) {
+            return;
+        }
+
+        uint64_t* parent_slot = path[i].parent_slot;
+        uint64_t replacement = 0;
+        if (count == 1) {
+            uint64_t remaining = table[last];
+            uint64_t prefix = ((vpn >> (9 * (5 - level))) << 9) | last;
+
+            if (level < 4 && entry_is_node(remaining)) {
+                replacement = remaining;
+            } else {
+                replacement = alloc_node(prefix, level + 1, remaining);
+            }
+        }
+
+        if (entry_is_node(*parent_slot)) {
+            free_node(*parent_slot);
+        }
+        *parent_slot = replacement;
+        free_page_frame(path[i].table_entry >> 12);
+        if (count == 1) {
+            return;
+        }
+    }
+}
+
+static void cpt_unmap(uint64_t pt, uint64_t vpn){
+    struct cpt_path path[5];
+    int depth = 1;
+    int level = 0;
+
+    path[0].table = table_at(pt);
+    path[0].table_entry = (pt << 12) | VALID_BIT;
+    path[0].level = 0;
+    path[0].parent_slot = NULL;
+
+    while (level < 4) {
+        uint64_t* slot = &path[depth - 1].table[index_at(vpn, level)];
+        uint64_t current_entry = *slot;
+        uint64_t next_entry = current_entry;
+
+        if (!entry_present(current_entry)) {
+            return;
+        }
+
+        if (entry_is_node(current_entry)) {
+            struct cpt_node* node = node_at(current_entry);
+            if (!node_matches(node, vpn)) {
+                return;
+            }
+
+            if (node_depth(node) == 5) {
+                free_node(current_entry);
+                *slot = 0;
+                cpt_collapse(path, depth, vpn);
+                return;
+            }
+            level = node_depth(node);
+            next_entry = node->entry;
+        } else {
+            level++;
+        }
+
+        path[depth].table = table_at(next_entry >> 12);
+        path[depth].table_entry = next_entry;
+        path[depth].level = level;
+        path[depth].parent_slot = slot;
+        depth++;
+    }
+
+    path[depth - 1].table[index_at(vpn, 4)] = 0;
+    cpt_collapse(path, depth, vpn);
+}
+
+void cpt_update(uint64_t pt, uint64_t vpn, uint64_t ppn){
+    vpn &= VPN_MASK;
+    if (ppn == NO_MAPPING) {
+        cpt_unmap(pt, vpn);
+    } else {
+        cpt_map(table_at(pt), vpn, (ppn << 12) | VALID_BIT);
+    }
+}
+
+static void cpt_destroy_table(uint64_t table_entry, int level){
+    uint64_t* table = table_at(table_entry >> 12);
+
+    for (int i = 0; level < 4 && i < 512; i++) {
+        uint64_t current_entry = table[i];
+        if (!entry_present(current_entry)) {
+            continue;
+        }
+
+        if (entry_is_node(current_entry)) {
+            struct cpt_node* node = node_at(current_entry);
+            if (node_depth(node) < 5) {
+                cpt_destroy_table(node->entry, node_depth(node));
+            }
+            free_node(current_entry);
+        } else {
+            cpt_destroy_table(current_entry, level + 1);
+        }
+    }
+
+    free_page_frame(table_entry >> 12);
+}
+
+void cpt_destroy(uint64_t pt){
+    cpt_destroy_table(pt << 12, 0);
+}
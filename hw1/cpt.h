@@ -0,0 +1,24 @@
+#ifndef CPT_H
+#define CPT_H
+
+#include <stdint.h>
+
+/*
+ * Path-compressed page table.
+ *
+ * Same 5-level, 9-bit radix layout as pt.c, except that a chain of tables
+ * with a single child is replaced by a 16-byte node holding the skipped vpn
+ * prefix and the entry it leads to. An isolated mapping costs one node
+ * instead of four tables. The root is an ordinary page frame, but compressed
+ * roots must only be used through the cpt_* functions.
+ *
+ * Nodes come from a pool of frames shared by all compressed roots. The pool
+ * has its own lock, and hands a frame back to the allocator once its last
+ * node is freed. Different roots may be changed from different threads, but
+ * one root must not be changed by two threads at once.
+ */
+void cpt_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+uint64_t cpt_query(uint64_t pt, uint64_t vpn);
+void cpt_destroy(uint64_t pt);
+
+#endif
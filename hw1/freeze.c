@@ -0,0 +1,151 @@
+#include "os.h"
+#include "freeze.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+#define KEYS_PER_BLOCK 8
+#define VPN_MASK ((1ULL << 45) - 1)
+#define KEY_PAD INT64_MAX
+
+// One block of keys is one cache line and is compared in a single vector operation.
+typedef int64_t key_block __attribute__((vector_size(KEYS_PER_BLOCK * sizeof(int64_t))));
+
+struct pt_extent {
+    uint64_t vpn;
+    uint64_t ppn;
+    uint64_t length;
+};
+
+struct pt_frozen {
+    size_t nblocks;
+    int64_t* keys;     // first vpn of each extent, in B-tree order
+    uint64_t* ppns;    // the rest of each extent, in the same order as keys
+    uint64_t* lengths;
+};
+
+struct extent_list {
+    struct pt_extent* extents;
+    size_t count;
+    size_t capacity;
+};
+
+static int collect_extent(uint64_t vpn, uint64_t* pte, void* arg){
+    struct extent_list* list = arg;
+    uint64_t ppn = *pte >> 12;
+
+    if (list->count > 0) {
+        struct pt_extent* last = &list->extents[list->count - 1];
+        if (last->vpn + last->length == vpn && last->ppn + last->length == ppn) {
+            last->length++;
+            return 0;
+        }
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->extents = realloc(list->extents, list->capacity * sizeof(*list->extents));
+        if (list->extents == NULL) {
+            fprintf(stderr, "Error! Failed to allocate extent list.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    list->extents[list->count].vpn = vpn;
+    list->extents[list->count].ppn = ppn;
+    list->extents[list->count].length = 1;
+    list->count++;
+    return 0;
+}
+
+static size_t child_block(size_t block, size_t i){
+    return block * (KEYS_PER_BLOCK + 1) + i + 1;
+}
+
+// Lays out the sorted extents in-order over the implicit tree; returns the next extent to place.
+static size_t layout(struct pt_frozen* frozen, const struct extent_list* list, size_t block, size_t next){
+    if (block >= frozen->nblocks) {
+        return next;
+    }
+
+    for (size_t i = 0; i < KEYS_PER_BLOCK; i++) {
+        size_t slot = block * KEYS_PER_BLOCK + i;
+
+        next = layout(frozen, list, child_block(block, i), next);
+        if (next < list->count) {
+            frozen->keys[slot] = (int64_t)list->extents[next].vpn;
+            frozen->ppns[slot] = list->extents[next].ppn;
+            frozen->lengths[slot] = list->extents[next].length;
+            next++;
+        } else {
+            frozen->keys[slot] = KEY_PAD;
+            frozen->ppns[slot] = NO_MAPPING;
+            frozen->lengths[slot] = 0;
+        }
+    }
+
+    return layout(frozen, list, child_block(block, KEYS_PER_BLOCK), next);
+}
+
+struct pt_frozen* page_table_freeze(uint64_t pt){
+    struct extent_list list = {0};
+    struct pt_frozen* frozen = malloc(sizeof(*frozen));
+
+    if (frozen == NULL) {
+        fprintf(stderr, "Error! Failed to allocate frozen page table.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    page_table_walk(pt, 0, VPN_MASK + 1, collect_extent, &list);
+
+    frozen->nblocks = (list.count + KEYS_PER_BLOCK - 1) / KEYS_PER_BLOCK;
+    if (frozen->nblocks == 0) {
+        frozen->nblocks = 1;
+    }
+    frozen->keys = aligned_alloc(64, frozen->nblocks * sizeof(key_block));
+    frozen->ppns = malloc(frozen->nblocks * KEYS_PER_BLOCK * sizeof(uint64_t));
+    frozen->lengths = malloc(frozen->nblocks * KEYS_PER_BLOCK * sizeof(uint64_t));
+    if (frozen->keys == NULL || frozen->ppns == NULL || frozen->lengths == NULL) {
+        fprintf(stderr, "Error! Failed to allocate frozen page table.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    layout(frozen, &list, 0, 0);
+    free(list.extents);
+    return frozen;
+}
+
+uint64_t page_table_frozen_query(const struct pt_frozen* frozen, uint64_t vpn){
+    const int64_t key = (int64_t)(vpn & VPN_MASK);
+    size_t found = SIZE_MAX;
+    size_t block = 0;
+
+    // Find the extent with the largest first vpn not above the key. Keys within a block are
+    // sorted, so the number of keys <= key is both the child to descend to and one past the
+    // best candidate in this block.
+    while (block < frozen->nblocks) {
+        key_block keys = *(const key_block*)&frozen->keys[block * KEYS_PER_BLOCK];
+        key_block below = keys <= key;
+        size_t count = 0;
+
+        for (int i = 0; i < KEYS_PER_BLOCK; i++) {
+            count -= below[i];
+        }
+
+        if (count > 0) {
+            found = block * KEYS_PER_BLOCK + count - 1;
+        }
+        block = child_block(block, count);
+    }
+
+    if (found == SIZE_MAX || (uint64_t)(key - frozen->keys[found]) >= frozen->lengths[found]) {
+        return NO_MAPPING;
+    }
+    return frozen->ppns[found] + (uint64_t)(key - frozen->keys[found]);
+}
+
+void page_table_frozen_free(struct pt_frozen* frozen){
+    free(frozen->keys);
+    free(frozen->ppns);
+    free(frozen->lengths);
+    free(frozen);
+}
@@ -0,0 +1,20 @@
+#ifndef FREEZE_H
+#define FREEZE_H
+
+#include <stdint.h>
+
+/*
+ * Read-only snapshot of a page table for mappings that never change.
+ *
+ * The mappings are coalesced into extents of consecutive vpns backed by
+ * consecutive ppns and stored as an implicit B-tree with 8 keys per cache
+ * line, so a lookup is a few vector compares instead of a 5-level walk.
+ * Later updates to the page table are not reflected in the snapshot.
+ */
+struct pt_frozen;
+
+struct pt_frozen *page_table_freeze(uint64_t pt);
+uint64_t page_table_frozen_query(const struct pt_frozen *frozen, uint64_t vpn);
+void page_table_frozen_free(struct pt_frozen *frozen);
+
+#endif
@@ -0,0 +1,469 @@
+#include "os.h"
+#include "ksm.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define INITIAL_BUCKETS 256
+
+struct ksm_page {
+    uint32_t checksum; // from the previous scan, 0 before the first
+};
+
+struct ksm_region {
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t count;
+    struct ksm_page* pages;
+};
+
+// A shared frame (stable) or a merge candidate from the current pass (unstable).
+struct ksm_node {
+    struct ksm_node* next;
+    uint64_t hash;
+    uint64_t ppn;
+    uint64_t pt;      // unstable: where the candidate is mapped
+    uint64_t vpn;
+    uint64_t sharers; // stable: pages mapped to ppn, as far as ksm has seen them go
+};
+
+struct ksm_table {
+    struct ksm_node** buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+struct ksm {
+    pthread_mutex_t lock;
+    struct ksm_region* regions;
+    size_t nregions;
+    size_t cursor_region;
+    uint64_t cursor_vpn;
+
+    struct ksm_table stable;
+    struct ksm_table unstable;
+    uint64_t pages_sharing;
+    uint64_t full_scans;
+    uint64_t pages_scanned;
+    uint64_t pass_start; // pages_scanned when the current pass started
+
+    pthread_t thread;
+    int running;
+    uint64_t pages_per_scan;
+    unsigned int sleep_ms;
+};
+
+static void* checked_alloc(size_t size){
+    void* memory = calloc(1, size);
+    if (memory == NULL) {
+        fprintf(stderr, "Error! Failed to allocate same-page merging state.\n");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static uint64_t hash_frame(const char* frame){
+    uint64_t hash = 0x243F6A8885A308D3ULL;
+
+    for (int i = 0; i < 4096; i += 8) {
+        uint64_t word;
+        memcpy(&word, frame + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static void table_init(struct ksm_table* table){
+    table->nbuckets = INITIAL_BUCKETS;
+    table->buckets = checked_alloc(table->nbuckets * sizeof(*table->buckets));
+    table->count = 0;
+}
+
+static struct ksm_node** bucket_of(struct ksm_table* table, uint64_t hash){
+    return &table->buckets[hash & (table->nbuckets - 1)];
+}
+
+static void table_insert(struct ksm_table* table, struct ksm_node* node){
+    if (table->count == table->nbuckets) {
+        struct ksm_node** old = table->buckets;
+        size_t old_count = table->nbuckets;
+
+        table->nbuckets *= 2;
+        table->buckets = checked_alloc(table->nbuckets * sizeof(*table->buckets));
+        for (size_t i = 0; i < old_count; i++) {
+            while (old[i] != NULL) {
+                struct ksm_node* moved = old[i];
+                old[i] = moved->next;
+                moved->next = *bucket_of(table, moved->hash);
+                *bucket_of(table, moved->hash) = moved;
+            }
+        }
+        free(old);
+    }
+
+    node->next = *bucket_of(table, node->hash);
+    *bucket_of(table, node->hash) = node;
+    table->count++;
+}
+
+static void table_remove(struct ksm_table* table, struct ksm_node* node){
+    struct ksm_node** link = bucket_of(table, node->hash);
+
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    table->count--;
+}
+
+// Drops ksm's own reference to every shared frame, freeing those no page maps anymore.
+static void release_stable(struct ksm* ksm){
+    for (size_t i = 0; i < ksm->stable.nbuckets; i++) {
+        for (struct ksm_node* node = ksm->stable.buckets[i]; node != NULL; node = node->next) {
+            free_page_frame(node->ppn);
+        }
+    }
+}
+
+static void table_clear(struct ksm_table* table){
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        while (table->buckets[i] != NULL) {
+            struct ksm_node* node = table->buckets[i];
+            table->buckets[i] = node->next;
+            free(node);
+        }
+    }
+    table->count = 0;
+}
+
+struct ksm* ksm_create(void){
+    struct ksm* ksm = checked_alloc(sizeof(*ksm));
+
+    pthread_mutex_init(&ksm->lock, NULL);
+    table_init(&ksm->stable);
+    table_init(&ksm->unstable);
+    return ksm;
+}
+
+void ksm_destroy(struct ksm* ksm){
+    ksm_stop(ksm);
+    for (size_t i = 0; i < ksm->nregions; i++) {
+        free(ksm->regions[i].pages);
+    }
+    free(ksm->regions);
+    release_stable(ksm);
+    table_clear(&ksm->stable);
+    table_clear(&ksm->unstable);
+    free(ksm->stable.buckets);
+    free(ksm->unstable.buckets);
+    pthread_mutex_destroy(&ksm->lock);
+    free(ksm);
+}
+
+void ksm_register(struct ksm* ksm, uint64_t pt, uint64_t vpn, uint64_t count){
+    pthread_mutex_lock(&ksm->lock);
+    ksm->regions = realloc(ksm->regions, (ksm->nregions + 1) * sizeof(*ksm->regions));
+    if (ksm->regions == NULL) {
+        fprintf(stderr, "Error! Failed to allocate same-page merging state.\n");
+        exit(EXIT_FAILURE);
+    }
+    ksm->regions[ksm->nregions].pt = pt;
+    ksm->regions[ksm->nregions].vpn = vpn;
+    ksm->regions[ksm->nregions].count = count;
+    ksm->regions[ksm->nregions].pages = checked_alloc(count * sizeof(struct ksm_page));
+    ksm->nregions++;
+    pthread_mutex_unlock(&ksm->lock);
+}
+
+// A merged entry: read-only, and copy-on-write if it could be written before.
+static uint64_t merged_pte(uint64_t ppn, uint64_t pte){
+    uint64_t cow = (pte & (PTE_WRITE | PTE_COW)) != 0 ? PTE_COW : 0;
+
+    return (ppn << 12) | (pte & 0xFFF & ~PTE_WRITE) | cow;
+}
+
+static int set_merged(uint64_t vpn, uint64_t* pte, void* arg){
+    (void)vpn;
+    (void)arg;
+    *pte = merged_pte(*pte >> 12, *pte);
+    return 1;
+}
+
+struct ksm_scan {
+    struct ksm* ksm;
+    struct ksm_region* region;
+    uint64_t budget;
+};
+
+// Maps the page being scanned onto a shared frame, with a reference of its own, and drops
+// the one it held on its old frame.
+static void merge_into(struct ksm_scan* scan, struct ksm_node* stable, uint64_t* pte){
+    page_frame_get(stable->ppn);
+    free_page_frame(*pte >> 12);
+    *pte = merged_pte(stable->ppn, *pte);
+    stable->sharers++;
+    scan->ksm->pages_sharing++;
+}
+
+static int scan_page(uint64_t vpn, uint64_t* pte, void* arg){
+    struct ksm_scan* scan = arg;
+    struct ksm* ksm = scan->ksm;
+    struct ksm_page* page = &scan->region->pages[vpn - scan->region->vpn];
+    uint64_t ppn = *pte >> 12;
+    const char* frame = frame_at(ppn);
+    uint64_t hash = hash_frame(frame);
+    uint32_t checksum = (uint32_t)hash | 1;
+
+    ksm->cursor_vpn = vpn + 1;
+    ksm->pages_scanned++;
+    scan->budget--;
+
+    // Already shared, or identical to a shared frame.
+    for (struct ksm_node* node = *bucket_of(&ksm->stable, hash); node != NULL; node = node->next) {
+        if (node->hash != hash) {
+            continue;
+        }
+        if (node->ppn == ppn) {
+            return scan->budget == 0;
+        }
+        if (memcmp(frame_at(node->ppn), frame, 4096) == 0) {
+            merge_into(scan, node, pte);
+            return scan->budget == 0;
+        }
+    }
+
+    // Pages still being written are not worth merging.
+    if (page->checksum != checksum) {
+        page->checksum = checksum;
+        return scan->budget == 0;
+    }
+
+    for (struct ksm_node* node = *bucket_of(&ksm->unstable, hash); node != NULL; node = node->next) {
+        if (node->hash != hash || node->ppn == ppn) {
+            continue;
+        }
+        // The candidate may have been rewritten or remapped since it was inserted.
+        uint64_t candidate_pte = page_table_query_pte(node->pt, node->vpn);
+        if ((candidate_pte & PTE_VALID) == 0 || (candidate_pte >> 12) != node->ppn
+            || memcmp(frame_at(node->ppn), frame, 4096) != 0) {
+            continue;
+        }
+
+        // The candidate's frame becomes the shared one. ksm keeps a reference of its own,
+        // so a write fault always copies it rather than writing it in place.
+        page_table_walk(node->pt, node->vpn, 1, set_merged, NULL);
+        page_frame_get(node->ppn);
+
+        table_remove(&ksm->unstable, node);
+        node->sharers = 1;
+        ksm->pages_sharing++;
+        table_insert(&ksm->stable, node);
+        merge_into(scan, node, pte);
+        return scan->budget == 0;
+    }
+
+    struct ksm_node* node = checked_alloc(sizeof(*node));
+    node->hash = hash;
+    node->ppn = ppn;
+    node->pt = scan->region->pt;
+    node->vpn = vpn;
+    table_insert(&ksm->unstable, node);
+    return scan->budget == 0;
+}
+
+// Forgets the shared frames only ksm still holds, whose pages were all written to or
+// unmapped without ksm_unmerge.
+static void prune_stable(struct ksm* ksm){
+    for (size_t i = 0; i < ksm->stable.nbuckets; i++) {
+        struct ksm_node** link = &ksm->stable.buckets[i];
+
+        while (*link != NULL) {
+            struct ksm_node* node = *link;
+
+            if (page_frame_refs(node->ppn) > 1) {
+                link = &node->next;
+                continue;
+            }
+            *link = node->next;
+            ksm->stable.count--;
+            ksm->pages_sharing -= node->sharers;
+            free_page_frame(node->ppn);
+            free(node);
+        }
+    }
+}
+
+static void scan_locked(struct ksm* ksm, uint64_t pages){
+    struct ksm_scan scan = {ksm, NULL, pages};
+
+    if (ksm->nregions == 0) {
+        return;
+    }
+
+    while (scan.budget > 0) {
+        struct ksm_region* region = &ksm->regions[ksm->cursor_region];
+        uint64_t end = region->vpn + region->count;
+
+        if (ksm->cursor_vpn < region->vpn) {
+            ksm->cursor_vpn = region->vpn;
+        }
+
+        scan.region = region;
+        if (ksm->cursor_vpn < end) {
+            page_table_walk(region->pt, ksm->cursor_vpn, end - ksm->cursor_vpn, scan_page, &scan);
+            if (scan.budget == 0 && ksm->cursor_vpn < end) {
+                return;
+            }
+        }
+
+        // Region done: move on, and start a new pass with a fresh unstable table after the last.
+        ksm->cursor_region++;
+        ksm->cursor_vpn = 0;
+        if (ksm->cursor_region == ksm->nregions) {
+            ksm->cursor_region = 0;
+            ksm->full_scans++;
+            table_clear(&ksm->unstable);
+            prune_stable(ksm);
+            // A pass that found no mapped page at all would otherwise spin.
+            if (ksm->pages_scanned == ksm->pass_start) {
+                return;
+            }
+            ksm->pass_start = ksm->pages_scanned;
+        }
+    }
+}
+
+void ksm_scan(struct ksm* ksm, uint64_t pages){
+    pthread_mutex_lock(&ksm->lock);
+    scan_locked(ksm, pages);
+    pthread_mutex_unlock(&ksm->lock);
+}
+
+static void* ksm_thread(void* arg){
+    struct ksm* ksm = arg;
+    struct timespec pause;
+
+    pause.tv_sec = ksm->sleep_ms / 1000;
+    pause.tv_nsec = (long)(ksm->sleep_ms % 1000) * 1000000;
+
+    pthread_mutex_lock(&ksm->lock);
+    while (ksm->running) {
+        scan_locked(ksm, ksm->pages_per_scan);
+        pthread_mutex_unlock(&ksm->lock);
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&ksm->lock);
+    }
+    pthread_mutex_unlock(&ksm->lock);
+    return NULL;
+}
+
+void ksm_start(struct ksm* ksm, uint64_t pages_per_scan, unsigned int sleep_ms){
+    pthread_mutex_lock(&ksm->lock);
+    if (ksm->running) {
+        pthread_mutex_unlock(&ksm->lock);
+        return;
+    }
+    ksm->running = 1;
+    ksm->pages_per_scan = pages_per_scan;
+    ksm->sleep_ms = sleep_ms;
+    pthread_mutex_unlock(&ksm->lock);
+
+    if (pthread_create(&ksm->thread, NULL, ksm_thread, ksm) != 0) {
+        fprintf(stderr, "Error! Failed to start same-page merging thread.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void ksm_stop(struct ksm* ksm){
+    int running;
+
+    pthread_mutex_lock(&ksm->lock);
+    running = ksm->running;
+    ksm->running = 0;
+    pthread_mutex_unlock(&ksm->lock);
+
+    if (running) {
+        pthread_join(ksm->thread, NULL);
+    }
+}
+
+void ksm_lock(struct ksm* ksm){
+    pthread_mutex_lock(&ksm->lock);
+}
+
+void ksm_unlock(struct ksm* ksm){
+    pthread_mutex_unlock(&ksm->lock);
+}
+
+static int set_private(uint64_t vpn, uint64_t* pte, void* arg){
+    (void)vpn;
+    *pte = *(uint64_t*)arg;
+    return 1;
+}
+
+static int unmerge_locked(struct ksm* ksm, uint64_t pt, uint64_t vpn){
+    uint64_t pte = page_table_query_pte(pt, vpn);
+    struct ksm_node* stable = NULL;
+    uint64_t ppn;
+
+    if ((pte & PTE_VALID) == 0) {
+        return 0;
+    }
+
+    ppn = pte >> 12;
+    for (struct ksm_node* node = *bucket_of(&ksm->stable, hash_frame(frame_at(ppn))); node != NULL;
+         node = node->next) {
+        if (node->ppn == ppn) {
+            stable = node;
+            break;
+        }
+    }
+    if (stable == NULL) {
+        return 0;
+    }
+
+    // The last sharer takes the shared frame over instead of copying it.
+    if (stable->sharers == 1) {
+        table_remove(&ksm->stable, stable);
+        free(stable);
+        free_page_frame(ppn); // ksm's own reference
+    } else {
+        uint64_t copy = alloc_page_frame();
+        memcpy(frame_at(copy), frame_at(ppn), 4096);
+        free_page_frame(ppn);
+        stable->sharers--;
+        ppn = copy;
+    }
+    ksm->pages_sharing--;
+
+    // Writable again, unless the frame is still mapped elsewhere, as after a fork.
+    pte = (ppn << 12) | (pte & 0xFFF);
+    if ((pte & PTE_COW) != 0 && page_frame_refs(ppn) == 1) {
+        pte = (pte & ~PTE_COW) | PTE_WRITE;
+    }
+    page_table_walk(pt, vpn, 1, set_private, &pte);
+    return 1;
+}
+
+int ksm_unmerge(struct ksm* ksm, uint64_t pt, uint64_t vpn){
+    int unmerged;
+
+    pthread_mutex_lock(&ksm->lock);
+    unmerged = unmerge_locked(ksm, pt, vpn);
+    pthread_mutex_unlock(&ksm->lock);
+    return unmerged;
+}
+
+void ksm_get_stats(struct ksm* ksm, struct ksm_stats* stats){
+    pthread_mutex_lock(&ksm->lock);
+    stats->full_scans = ksm->full_scans;
+    stats->pages_scanned = ksm->pages_scanned;
+    stats->pages_shared = ksm->stable.count;
+    stats->pages_sharing = ksm->pages_sharing;
+    stats->frames_freed = ksm->pages_sharing - ksm->stable.count;
+    pthread_mutex_unlock(&ksm->lock);
+}
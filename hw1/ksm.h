@@ -0,0 +1,53 @@
+#ifndef KSM_H
+#define KSM_H
+
+#include <stdint.h>
+
+/*
+ * Same-page merging, after Linux KSM.
+ *
+ * Registered ranges of any number of roots are scanned a few pages at a
+ * time. Pages whose contents match a page seen before are remapped to one
+ * shared frame, read-only, and their own frames are freed. As in Linux, a
+ * page only becomes a merge candidate once its contents have not changed
+ * between two scans, so pages that are being written are left alone.
+ *
+ * Merged pages are copy-on-write: each holds a reference to the shared
+ * frame, and ksm holds one more, so a write through vm.c gives the page a
+ * private copy. ksm_unmerge does the same ahead of time. Pages written to
+ * or unmapped without ksm_unmerge stay in the counts until a full scan
+ * finds their shared frame unused. A frame in a registered range that is
+ * also mapped elsewhere must be copy-on-write there, as after a fork.
+ *
+ * ksm_start runs ksm_scan on a background thread. While it runs, take
+ * ksm_lock around any other change to a registered root, and flush the vm
+ * TLBs of registered roots after ksm_unlock.
+ */
+struct ksm;
+
+struct ksm_stats {
+	uint64_t full_scans;
+	uint64_t pages_scanned;
+	uint64_t pages_shared;		/* shared frames in use */
+	uint64_t pages_sharing;		/* pages mapped to a shared frame */
+	uint64_t frames_freed;		/* net of unmerging */
+};
+
+struct ksm *ksm_create(void);
+void ksm_destroy(struct ksm *ksm);
+void ksm_register(struct ksm *ksm, uint64_t pt, uint64_t vpn, uint64_t count);
+
+/* Scan up to pages mapped pages, continuing where the last call stopped */
+void ksm_scan(struct ksm *ksm, uint64_t pages);
+
+void ksm_start(struct ksm *ksm, uint64_t pages_per_scan, unsigned int sleep_ms);
+void ksm_stop(struct ksm *ksm);
+void ksm_lock(struct ksm *ksm);
+void ksm_unlock(struct ksm *ksm);
+
+/* Give a merged page its own writable frame; returns 0 if it was not merged */
+int ksm_unmerge(struct ksm *ksm, uint64_t pt, uint64_t vpn);
+
+void ksm_get_stats(struct ksm *ksm, struct ksm_stats *stats);
+
+#endif
@@ -0,0 +1,138 @@
+#include "os.h"
+#include "nested.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+void nested_flush(struct nested_mmu* mmu){
+    for (int i = 0; i < NESTED_TLB_ENTRIES; i++) {
+        mmu->tlb[i].gvpn = NO_MAPPING;
+    }
+    for (int i = 0; i < NESTED_NWC_ENTRIES; i++) {
+        mmu->nwc[i].gvpn = NO_MAPPING;
+    }
+}
+
+int nested_init(struct nested_mmu* mmu, uint64_t hpt){
+    mmu->hpt = hpt;
+    mmu->next_gppn = 0;
+    mmu->use_tlb = 1;
+    mmu->use_nwc = 1;
+    mmu->stats = (struct nested_stats){0};
+    nested_flush(mmu);
+    mmu->gpt = nested_alloc_guest_frame(mmu);
+    return mmu->gpt == NO_MAPPING ? -1 : 0;
+}
+
+// Guest-physical memory is handed out linearly, each frame backed by a fresh host frame.
+uint64_t nested_alloc_guest_frame(struct nested_mmu* mmu){
+    uint64_t hppn = alloc_page_frame();
+
+    if (page_table_update_checked(mmu->hpt, mmu->next_gppn, hppn) != 0) {
+        free_page_frame(hppn);
+        return NO_MAPPING;
+    }
+    return mmu->next_gppn++;
+}
+
+// One host dimension walk: guest-physical frame to host frame.
+static uint64_t host_translate(struct nested_mmu* mmu, uint64_t gppn){
+    mmu->stats.host_walks++;
+    mmu->stats.memory_refs += 5;
+    return page_table_query(mmu->hpt, gppn);
+}
+
+// Host view of a guest page table frame, through the nested walk cache.
+static uint64_t* guest_table(struct nested_mmu* mmu, uint64_t gppn){
+    struct nested_tlb_entry* cached = &mmu->nwc[gppn % NESTED_NWC_ENTRIES];
+    uint64_t hppn;
+
+    if (mmu->use_nwc && cached->gvpn == gppn) {
+        mmu->stats.nwc_hits++;
+        hppn = cached->hppn;
+    } else {
+        hppn = host_translate(mmu, gppn);
+        if (hppn == NO_MAPPING) {
+            return NULL;
+        }
+        cached->gvpn = gppn;
+        cached->hppn = hppn;
+    }
+
+    return (uint64_t*)(phys_to_virt(hppn << 12));
+}
+
+uint64_t nested_query(struct nested_mmu* mmu, uint64_t gvpn){
+    struct nested_tlb_entry* cached = &mmu->tlb[gvpn % NESTED_TLB_ENTRIES];
+    uint64_t gppn = mmu->gpt;
+    uint64_t hppn;
+
+    mmu->stats.translations++;
+    if (mmu->use_tlb && cached->gvpn == gvpn) {
+        mmu->stats.tlb_hits++;
+        return cached->hppn;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        uint64_t* table = guest_table(mmu, gppn);
+        uint64_t current_entry;
+
+        if (table == NULL) {
+            return NO_MAPPING;
+        }
+
+        current_entry = table[(gvpn >> (36 - (9 * i))) & 0x1FF];
+        mmu->stats.memory_refs++;
+        if ((current_entry & 1) == 0 || current_entry == NO_MAPPING) {
+            return NO_MAPPING;
+        }
+        gppn = current_entry >> 12;
+    }
+
+    hppn = host_translate(mmu, gppn);
+    if (hppn != NO_MAPPING) {
+        cached->gvpn = gvpn;
+        cached->hppn = hppn;
+    }
+    return hppn;
+}
+
+int nested_guest_update(struct nested_mmu* mmu, uint64_t gvpn, uint64_t gppn){
+    uint64_t table_gppn = mmu->gpt;
+    uint64_t* table;
+
+    mmu->tlb[gvpn % NESTED_TLB_ENTRIES].gvpn = NO_MAPPING;
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t index = (gvpn >> (36 - (9 * i))) & 0x1FF;
+        uint64_t current_entry;
+
+        table = guest_table(mmu, table_gppn);
+        if (table == NULL) {
+            fprintf(stderr, "Error! Guest page table frame is not backed by the host at level %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+
+        current_entry = table[index];
+        if (current_entry == NO_MAPPING || (current_entry & 1) == 0) {
+            if (gppn == NO_MAPPING) {
+                return 0;
+            }
+
+            uint64_t table_frame = nested_alloc_guest_frame(mmu);
+            if (table_frame == NO_MAPPING) {
+                return -1;
+            }
+            current_entry = (table_frame << 12) | 1;
+            table[index] = current_entry;
+        }
+        table_gppn = current_entry >> 12;
+    }
+
+    table = guest_table(mmu, table_gppn);
+    if (table == NULL) {
+        fprintf(stderr, "Error! Guest page table frame is not backed by the host at level 4.\n");
+        exit(EXIT_FAILURE);
+    }
+    table[gvpn & 0x1FF] = gppn == NO_MAPPING ? NO_MAPPING : (gppn << 12) | 1;
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef NESTED_H
+#define NESTED_H
+
+#include <stdint.h>
+
+/*
+ * Two-dimensional (nested) paging.
+ *
+ * The guest page table has the same format as pt.c, but its root and table
+ * entries hold guest-physical frame numbers. Every guest-physical frame is
+ * translated through the host page table, whose vpns are guest-physical
+ * frame numbers. A full walk costs up to 5 host walks for the guest tables
+ * plus one for the final frame.
+ *
+ * Two caches cut this down: a nested TLB from guest vpn straight to host
+ * frame, and a nested walk cache from guest table frames to the host frames
+ * backing them. The stats count every table entry read so that the cost of
+ * each configuration can be measured.
+ */
+#define NESTED_TLB_ENTRIES	64
+#define NESTED_NWC_ENTRIES	32
+
+struct nested_stats {
+	uint64_t translations;
+	uint64_t tlb_hits;
+	uint64_t nwc_hits;
+	uint64_t host_walks;
+	uint64_t memory_refs;	/* guest and host table entries read */
+};
+
+struct nested_tlb_entry {
+	uint64_t gvpn;		/* NO_MAPPING when empty */
+	uint64_t hppn;
+};
+
+struct nested_mmu {
+	uint64_t gpt;		/* guest root, a guest-physical frame number */
+	uint64_t hpt;		/* host root */
+	uint64_t next_gppn;
+	int use_tlb;
+	int use_nwc;
+	struct nested_tlb_entry tlb[NESTED_TLB_ENTRIES];
+	struct nested_tlb_entry nwc[NESTED_NWC_ENTRIES];	/* gvpn holds the gppn */
+	struct nested_stats stats;
+};
+
+/*
+ * Guest frames are backed with page_table_update_checked, so an accounted
+ * host root can refuse them: nested_alloc_guest_frame then returns
+ * NO_MAPPING, and nested_init and nested_guest_update return -1, all with
+ * errno set. A refused nested_guest_update leaves the leaf mapping
+ * unchanged, but guest tables it linked in before the refusal stay, empty,
+ * since guest-physical frames are handed out linearly and never returned.
+ */
+int nested_init(struct nested_mmu *mmu, uint64_t hpt);
+uint64_t nested_alloc_guest_frame(struct nested_mmu *mmu);
+int nested_guest_update(struct nested_mmu *mmu, uint64_t gvpn, uint64_t gppn);
+uint64_t nested_query(struct nested_mmu *mmu, uint64_t gvpn);
+void nested_flush(struct nested_mmu *mmu);
+
+#endif
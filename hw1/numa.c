@@ -0,0 +1,168 @@
+#include "os.h"
+#include "numa.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+struct numa_copy {
+    struct pt_mapping* mappings;
+    size_t count;
+    size_t capacity;
+};
+
+void numa_pt_init(struct numa_pt* npt, unsigned int nnodes, int replicate){
+    if (nnodes == 0 || nnodes > NUMA_MAX_NODES) {
+        fprintf(stderr, "Error! Number of NUMA nodes must be 1 to %d.\n", NUMA_MAX_NODES);
+        exit(EXIT_FAILURE);
+    }
+
+    npt->nnodes = nnodes;
+    npt->replicate = replicate;
+    npt->log_tail = 0;
+    pthread_mutex_init(&npt->log_lock, NULL);
+    for (unsigned int i = 0; i < NUMA_MAX_NODES; i++) {
+        struct numa_replica* replica = &npt->replicas[i];
+
+        pthread_rwlock_init(&replica->lock, NULL);
+        replica->pt = 0;
+        replica->applied = 0;
+        replica->local_refs = 0;
+        replica->remote_refs = 0;
+    }
+    npt->replicas[NUMA_HOME_NODE].pt = alloc_page_frame();
+}
+
+void numa_pt_destroy(struct numa_pt* npt){
+    for (unsigned int i = 0; i < NUMA_MAX_NODES; i++) {
+        if (npt->replicas[i].pt != 0) {
+            page_table_destroy(npt->replicas[i].pt);
+        }
+        pthread_rwlock_destroy(&npt->replicas[i].lock);
+    }
+    pthread_mutex_destroy(&npt->log_lock);
+}
+
+static void apply(uint64_t pt, const struct numa_op* op){
+    if (op->ppn == NO_MAPPING) {
+        page_table_unmap_range(pt, op->vpn, 1);
+    } else {
+        page_table_update(pt, op->vpn, op->ppn);
+    }
+}
+
+// Replays the log entries a replica has not seen. Called with the replica's write lock.
+static void replay(struct numa_pt* npt, struct numa_replica* replica){
+    uint64_t tail = __atomic_load_n(&npt->log_tail, __ATOMIC_ACQUIRE);
+    uint64_t applied = replica->applied;
+
+    for (; applied < tail; applied++) {
+        apply(replica->pt, &npt->log[applied % NUMA_LOG_SIZE]);
+    }
+    __atomic_store_n(&replica->applied, applied, __ATOMIC_RELEASE);
+}
+
+static int copy_mapping(uint64_t vpn, uint64_t* pte, void* arg){
+    struct numa_copy* copy = arg;
+
+    if (copy->count == copy->capacity) {
+        copy->capacity = copy->capacity ? copy->capacity * 2 : 512;
+        copy->mappings = realloc(copy->mappings, copy->capacity * sizeof(*copy->mappings));
+        if (copy->mappings == NULL) {
+            fprintf(stderr, "Error! Failed to allocate replica mappings.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    copy->mappings[copy->count].vpn = vpn;
+    copy->mappings[copy->count].ppn = *pte >> 12;
+    copy->count++;
+    return 0;
+}
+
+// First touch from a node: build its replica from the home node's, which is brought up to
+// date first. Called with the new replica's write lock; the home lock always comes second.
+// The replica is published before the home lock is dropped, so that appenders never
+// overwrite log entries it still needs.
+static void create_replica(struct numa_pt* npt, struct numa_replica* replica){
+    struct numa_replica* home = &npt->replicas[NUMA_HOME_NODE];
+    struct numa_copy copy = {NULL, 0, 0};
+    uint64_t pt = alloc_page_frame();
+
+    pthread_rwlock_wrlock(&home->lock);
+    replay(npt, home);
+    page_table_walk(home->pt, 0, 1ULL << 45, copy_mapping, &copy);
+    page_table_build(pt, copy.mappings, copy.count);
+    __atomic_store_n(&replica->applied, home->applied, __ATOMIC_RELAXED);
+    __atomic_store_n(&replica->pt, pt, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&home->lock);
+
+    free(copy.mappings);
+}
+
+static struct numa_replica* replica_for(struct numa_pt* npt, unsigned int node){
+    if (node >= npt->nnodes) {
+        fprintf(stderr, "Error! NUMA node %u out of range.\n", node);
+        exit(EXIT_FAILURE);
+    }
+    return &npt->replicas[npt->replicate ? node : NUMA_HOME_NODE];
+}
+
+// Brings a replica up to date, creating it if needed. Called with its write lock.
+static void catch_up(struct numa_pt* npt, struct numa_replica* replica){
+    if (replica->pt == 0) {
+        create_replica(npt, replica);
+    }
+    replay(npt, replica);
+}
+
+static int behind(struct numa_pt* npt, struct numa_replica* replica){
+    return replica->pt == 0
+        || __atomic_load_n(&replica->applied, __ATOMIC_ACQUIRE) < __atomic_load_n(&npt->log_tail, __ATOMIC_ACQUIRE);
+}
+
+void numa_pt_update(struct numa_pt* npt, unsigned int node, uint64_t vpn, uint64_t ppn){
+    struct numa_replica* replica = replica_for(npt, node);
+
+    pthread_mutex_lock(&npt->log_lock);
+
+    // A full log means some replica lags a whole log behind: replay for it before the
+    // oldest entry is overwritten.
+    for (unsigned int i = 0; i < NUMA_MAX_NODES; i++) {
+        struct numa_replica* lagging = &npt->replicas[i];
+        uint64_t applied = __atomic_load_n(&lagging->applied, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&lagging->pt, __ATOMIC_ACQUIRE) != 0 && npt->log_tail - applied == NUMA_LOG_SIZE) {
+            pthread_rwlock_wrlock(&lagging->lock);
+            replay(npt, lagging);
+            pthread_rwlock_unlock(&lagging->lock);
+        }
+    }
+
+    npt->log[npt->log_tail % NUMA_LOG_SIZE].vpn = vpn;
+    npt->log[npt->log_tail % NUMA_LOG_SIZE].ppn = ppn;
+    __atomic_store_n(&npt->log_tail, npt->log_tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&npt->log_lock);
+
+    pthread_rwlock_wrlock(&replica->lock);
+    catch_up(npt, replica);
+    pthread_rwlock_unlock(&replica->lock);
+}
+
+uint64_t numa_pt_query(struct numa_pt* npt, unsigned int node, uint64_t vpn){
+    struct numa_replica* replica = replica_for(npt, node);
+    int local = replica == &npt->replicas[node];
+    uint64_t ppn;
+
+    pthread_rwlock_rdlock(&replica->lock);
+    if (behind(npt, replica)) {
+        pthread_rwlock_unlock(&replica->lock);
+        pthread_rwlock_wrlock(&replica->lock);
+        catch_up(npt, replica);
+        pthread_rwlock_unlock(&replica->lock);
+        pthread_rwlock_rdlock(&replica->lock);
+    }
+    ppn = page_table_query(replica->pt, vpn);
+    pthread_rwlock_unlock(&replica->lock);
+
+    __atomic_fetch_add(local ? &npt->replicas[node].local_refs : &npt->replicas[node].remote_refs, 5,
+                       __ATOMIC_RELAXED);
+    return ppn;
+}
@@ -0,0 +1,54 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A page table replicated per NUMA node, after Mitosis and node replication.
+ *
+ * Every node can get its own copy of the page table, so that translation
+ * threads only walk tables on their own node. Updates are appended to a
+ * shared operation log and applied to the caller's replica. Any other
+ * replica replays the log before its next query, under its own lock. A
+ * replica is built on the first query or update from its node, by copying
+ * the home node's replica.
+ *
+ * Nodes are logical. Every walk is counted as local or remote by the node
+ * its tables were built for, five table reads per walk as in nested.c. With
+ * replication off, every node walks the home node's tables.
+ */
+#define NUMA_MAX_NODES	8
+#define NUMA_LOG_SIZE	1024
+#define NUMA_HOME_NODE	0
+
+struct numa_op {
+	uint64_t vpn;
+	uint64_t ppn;		/* NO_MAPPING unmaps */
+};
+
+struct numa_replica {
+	pthread_rwlock_t lock;
+	uint64_t pt;		/* 0 until the node first uses it */
+	uint64_t applied;	/* log entries replayed into pt */
+	uint64_t local_refs;	/* table reads by walks from this node */
+	uint64_t remote_refs;
+};
+
+struct numa_pt {
+	unsigned int nnodes;
+	int replicate;
+	pthread_mutex_t log_lock;	/* serializes appends */
+	uint64_t log_tail;		/* entries appended so far */
+	struct numa_op log[NUMA_LOG_SIZE];
+	struct numa_replica replicas[NUMA_MAX_NODES];
+};
+
+void numa_pt_init(struct numa_pt *npt, unsigned int nnodes, int replicate);
+void numa_pt_destroy(struct numa_pt *npt);
+
+/* page_table_update and page_table_query, called from a thread on node */
+void numa_pt_update(struct numa_pt *npt, unsigned int node, uint64_t vpn, uint64_t ppn);
+uint64_t numa_pt_query(struct numa_pt *npt, unsigned int node, uint64_t vpn);
+
+#endif
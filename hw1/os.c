@@ -2,51 +2,562 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <err.h>
+#include <pthread.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "os.h"
+#include "cpt.h"
+#include "freeze.h"
+#include "ksm.h"
+#include "nested.h"
+#include "numa.h"
+#include "ptl.h"
+#include "swap.h"
+#include "vm.h"
+#include "vma.h"
+#include "wss.h"
 
-/* 2^20 pages ought to be enough for anybody */
-#define NPAGES (1024 * 1024)
+#define PPN_BASE 0xbaaaaaad
+#define NO_FRAME UINT32_MAX
 
-static char *pages[NPAGES];
+/*
+ * Frames are looked up through a sparse directory: a static top level,
+ * middle levels and chunks allocated as memory grows. A chunk describes one
+ * max-order block, so 2^30 frames can be addressed while a small run pays
+ * for a few KiB of metadata.
+ */
+#define CHUNK_BITS	FRAME_MAX_ORDER
+#define CHUNK_FRAMES	(1ULL << CHUNK_BITS)
+#define DIR_BITS	10
+#define DIR_ENTRIES	(1 << DIR_BITS)
+#define MAX_FRAMES	(CHUNK_FRAMES << (2 * DIR_BITS))
 
-uint64_t alloc_page_frame(void)
+/* frame indices count from the chunk-aligned ppn below PPN_BASE */
+#define FRAME_BASE	(PPN_BASE & ~(CHUNK_FRAMES - 1))
+
+/* a frame has been handed out before and must be zeroed on reuse */
+#define FRAME_DIRTY	0x1
+#define FRAME_USED	0x2
+
+/*
+ * Physical memory is a buddy allocator over frame indices. Memory is taken
+ * from the host one chunk at a time, so a block of 2^order frames is
+ * physically and host contiguous and its ppn is a multiple of 2^order.
+ */
+struct frame {
+	void *private;		/* owner's data while allocated */
+	uint32_t next, prev;	/* free list links */
+	uint32_t refs;		/* references; a block's are kept at its head */
+	uint8_t order;		/* order + 1 if this frame heads a free block */
+	uint8_t flags;
+	uint8_t lock;		/* page table lock, see page_frame_lock */
+};
+
+struct frame_chunk {
+	char *va;
+	struct frame frames[CHUNK_FRAMES];
+};
+
+static struct frame_chunk **frame_dir[DIR_ENTRIES];
+static uint32_t free_lists[FRAME_MAX_ORDER + 1] = {
+	[0 ... FRAME_MAX_ORDER] = NO_FRAME
+};
+static uint64_t nframes_end = CHUNK_FRAMES;	/* the first chunk above PPN_BASE */
+static uint64_t nframes_total;
+static uint64_t nframes_used;
+static uint64_t nframes_limit;		/* 0 for as much as the host gives */
+static pthread_mutex_t frames_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* lock-free for readers: directory entries are only ever published once */
+static struct frame_chunk *chunk_of(uint64_t idx)
+{
+	struct frame_chunk **mid;
+
+	if (idx >= MAX_FRAMES)
+		return NULL;
+
+	mid = __atomic_load_n(&frame_dir[idx >> (CHUNK_BITS + DIR_BITS)], __ATOMIC_ACQUIRE);
+	if (mid == NULL)
+		return NULL;
+
+	return __atomic_load_n(&mid[(idx >> CHUNK_BITS) & (DIR_ENTRIES - 1)], __ATOMIC_ACQUIRE);
+}
+
+static struct frame *frame_of(uint64_t idx)
+{
+	return &chunk_of(idx)->frames[idx & (CHUNK_FRAMES - 1)];
+}
+
+static void free_list_add(uint64_t idx, unsigned int order)
+{
+	struct frame *f = frame_of(idx);
+
+	f->order = order + 1;
+	f->prev = NO_FRAME;
+	f->next = free_lists[order];
+	if (f->next != NO_FRAME)
+		frame_of(f->next)->prev = idx;
+	free_lists[order] = idx;
+}
+
+static void free_list_del(uint64_t idx, unsigned int order)
+{
+	struct frame *f = frame_of(idx);
+
+	if (f->prev != NO_FRAME)
+		frame_of(f->prev)->next = f->next;
+	else
+		free_lists[order] = f->next;
+	if (f->next != NO_FRAME)
+		frame_of(f->next)->prev = f->prev;
+	f->order = 0;
+}
+
+/* take another chunk from the host; called with frames_lock held */
+static int grow(void)
+{
+	uint64_t idx = nframes_end;
+	struct frame_chunk ***mid = &frame_dir[idx >> (CHUNK_BITS + DIR_BITS)];
+	struct frame_chunk *chunk;
+
+	if (idx + CHUNK_FRAMES > MAX_FRAMES)
+		return -1;
+
+	if (*mid == NULL) {
+		struct frame_chunk **new_mid = calloc(DIR_ENTRIES, sizeof(*new_mid));
+
+		if (new_mid == NULL)
+			return -1;
+		__atomic_store_n(mid, new_mid, __ATOMIC_RELEASE);
+	}
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (chunk == NULL)
+		return -1;
+
+	chunk->va = mmap(NULL, CHUNK_FRAMES * 4096, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (chunk->va == MAP_FAILED) {
+		free(chunk);
+		return -1;
+	}
+
+	__atomic_store_n(&(*mid)[(idx >> CHUNK_BITS) & (DIR_ENTRIES - 1)], chunk, __ATOMIC_RELEASE);
+	nframes_end += CHUNK_FRAMES;
+	nframes_total += CHUNK_FRAMES;
+	free_list_add(idx, FRAME_MAX_ORDER);
+	return 0;
+}
+
+/* returns NO_FRAME when the host cannot give more memory */
+static uint64_t try_alloc_frames(unsigned int order)
+{
+	unsigned int k = order;
+	struct frame_chunk *chunk;
+	uint64_t idx;
+
+	pthread_mutex_lock(&frames_lock);
+	if (nframes_limit != 0 && nframes_used + (1ULL << order) > nframes_limit) {
+		pthread_mutex_unlock(&frames_lock);
+		return NO_FRAME;
+	}
+	while (k <= FRAME_MAX_ORDER && free_lists[k] == NO_FRAME)
+		k++;
+	if (k > FRAME_MAX_ORDER) {
+		if (grow() != 0) {
+			pthread_mutex_unlock(&frames_lock);
+			return NO_FRAME;
+		}
+		k = FRAME_MAX_ORDER;
+	}
+
+	idx = free_lists[k];
+	free_list_del(idx, k);
+
+	/* split, handing the upper halves back */
+	while (k > order) {
+		k--;
+		free_list_add(idx + (1ULL << k), k);
+	}
+
+	/* a block never crosses a chunk */
+	chunk = chunk_of(idx);
+	for (uint64_t i = idx; i < idx + (1ULL << order); i++) {
+		chunk->frames[i & (CHUNK_FRAMES - 1)].flags |= FRAME_USED;
+		/* also for frames a caller splits off the block to free alone */
+		chunk->frames[i & (CHUNK_FRAMES - 1)].refs = 1;
+	}
+	nframes_used += 1ULL << order;
+	pthread_mutex_unlock(&frames_lock);
+
+	/* callers expect zeroed frames, as from mmap */
+	for (uint64_t i = idx; i < idx + (1ULL << order); i++) {
+		struct frame *f = &chunk->frames[i & (CHUNK_FRAMES - 1)];
+
+		if (f->flags & FRAME_DIRTY)
+			memset(chunk->va + (i & (CHUNK_FRAMES - 1)) * 4096, 0, 4096);
+		f->flags |= FRAME_DIRTY;
+	}
+
+	return idx + FRAME_BASE;
+}
+
+uint64_t alloc_page_frames(unsigned int order)
 {
-	static uint64_t nalloc;
 	uint64_t ppn;
-	void *va;
 
-	if (nalloc == NPAGES)
+	if (order > FRAME_MAX_ORDER)
+		errx(1, "allocation order %u too large", order);
+
+	ppn = try_alloc_frames(order);
+	if (ppn == NO_FRAME)
 		errx(1, "out of physical memory");
+	return ppn;
+}
+
+void set_page_frame_limit(uint64_t frames)
+{
+	pthread_mutex_lock(&frames_lock);
+	nframes_limit = frames;
+	pthread_mutex_unlock(&frames_lock);
+}
+
+int reserve_page_frames(struct frame_reserve *reserve, unsigned int count)
+{
+	unsigned int had = reserve->count;
+
+	if (count > FRAME_RESERVE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (reserve->count < count) {
+		uint64_t ppn = try_alloc_frames(0);
+
+		if (ppn == NO_FRAME) {
+			/* all or nothing: give back what this call took */
+			while (reserve->count > had)
+				free_page_frame(reserve->ppns[--reserve->count]);
+			errno = ENOMEM;
+			return -1;
+		}
+		reserve->ppns[reserve->count++] = ppn;
+	}
+	return 0;
+}
+
+uint64_t take_reserved_frame(struct frame_reserve *reserve)
+{
+	if (reserve->count == 0)
+		errx(1, "frame reserve is empty");
+	return reserve->ppns[--reserve->count];
+}
+
+void release_page_frames(struct frame_reserve *reserve)
+{
+	while (reserve->count > 0)
+		free_page_frame(reserve->ppns[--reserve->count]);
+}
+
+static struct frame *allocated_frame(uint64_t ppn)
+{
+	uint64_t idx = ppn - FRAME_BASE;
+	struct frame_chunk *chunk = chunk_of(idx);
+
+	if (chunk == NULL || !(chunk->frames[idx & (CHUNK_FRAMES - 1)].flags & FRAME_USED))
+		errx(1, "referencing unallocated frame");
+	return &chunk->frames[idx & (CHUNK_FRAMES - 1)];
+}
+
+void page_frame_get(uint64_t ppn)
+{
+	if (__atomic_fetch_add(&allocated_frame(ppn)->refs, 1, __ATOMIC_RELAXED) == 0)
+		errx(1, "referencing a frame that is being freed");
+}
+
+int page_frame_put_testzero(uint64_t ppn)
+{
+	uint32_t refs = __atomic_fetch_sub(&allocated_frame(ppn)->refs, 1, __ATOMIC_ACQ_REL);
+
+	if (refs == 0)
+		errx(1, "freeing unallocated frame");
+	return refs == 1;
+}
+
+uint32_t page_frame_refs(uint64_t ppn)
+{
+	uint64_t idx = ppn - FRAME_BASE;
+	struct frame_chunk *chunk = chunk_of(idx);
+	struct frame *f;
+
+	if (chunk == NULL)
+		return 0;
+	f = &chunk->frames[idx & (CHUNK_FRAMES - 1)];
+	return f->flags & FRAME_USED ? __atomic_load_n(&f->refs, __ATOMIC_RELAXED) : 0;
+}
+
+void free_page_frames(uint64_t ppn, unsigned int order)
+{
+	uint64_t idx = ppn - FRAME_BASE;
+	struct frame_chunk *chunk = chunk_of(idx);
+	struct frame *head;
+	uint32_t refs;
+
+	if (order > FRAME_MAX_ORDER || chunk == NULL || (idx & ((1ULL << order) - 1)) != 0)
+		errx(1, "freeing unallocated frame");
+
+	/*
+	 * Drop a reference, freeing only with the last one. After
+	 * page_frame_put_testzero the count is already 0 and this frees.
+	 */
+	head = &chunk->frames[idx & (CHUNK_FRAMES - 1)];
+	refs = __atomic_load_n(&head->refs, __ATOMIC_RELAXED);
+	while (refs > 1 && !__atomic_compare_exchange_n(&head->refs, &refs, refs - 1, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		;
+	if (refs > 1)
+		return;
+	head->refs = 0;
+
+	pthread_mutex_lock(&frames_lock);
+	for (uint64_t i = idx; i < idx + (1ULL << order); i++) {
+		struct frame *f = &chunk->frames[i & (CHUNK_FRAMES - 1)];
+
+		if (!(f->flags & FRAME_USED))
+			errx(1, "freeing unallocated frame");
+		f->flags &= ~FRAME_USED;
+		f->private = NULL;
+	}
+	nframes_used -= 1ULL << order;
 
+	/* merge with the buddy for as long as it is free as a whole */
+	while (order < FRAME_MAX_ORDER) {
+		uint64_t buddy = idx ^ (1ULL << order);
+
+		if (chunk->frames[buddy & (CHUNK_FRAMES - 1)].order != order + 1)
+			break;
+		free_list_del(buddy, order);
+		if (buddy < idx)
+			idx = buddy;
+		order++;
+	}
+	free_list_add(idx, order);
+	pthread_mutex_unlock(&frames_lock);
+}
+
+uint64_t alloc_page_frame(void)
+{
 	/* OS memory management isn't really this simple */
-	ppn = nalloc;
-	nalloc++;
+	return alloc_page_frames(0);
+}
+
+void free_page_frame(uint64_t ppn)
+{
+	free_page_frames(ppn, 0);
+}
+
+void page_frame_stats(struct frame_stats *stats)
+{
+	uint64_t above = 0;
 
-	va = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (va == MAP_FAILED)
-		err(1, "mmap failed");
+	pthread_mutex_lock(&frames_lock);
+	stats->total = nframes_total;
+	stats->free = 0;
+	for (int k = 0; k <= FRAME_MAX_ORDER; k++) {
+		stats->free_blocks[k] = 0;
+		for (uint32_t i = free_lists[k]; i != NO_FRAME; i = frame_of(i)->next)
+			stats->free_blocks[k]++;
+		stats->free += stats->free_blocks[k] << k;
+	}
+	pthread_mutex_unlock(&frames_lock);
+
+	/* like the kernel's unusable free space index */
+	for (int k = FRAME_MAX_ORDER; k >= 0; k--) {
+		above += stats->free_blocks[k] << k;
+		stats->unusable[k] = stats->free ? (double)(stats->free - above) / stats->free : 0;
+	}
+}
+
+void page_frame_lock(uint64_t ppn)
+{
+	uint8_t *lock = &frame_of(ppn - FRAME_BASE)->lock;
 
-	pages[ppn] = va;
-	return ppn + 0xbaaaaaad;
+	while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			;
+}
+
+void page_frame_unlock(uint64_t ppn)
+{
+	__atomic_clear(&frame_of(ppn - FRAME_BASE)->lock, __ATOMIC_RELEASE);
+}
+
+void page_frame_set_private(uint64_t ppn, void *private)
+{
+	frame_of(ppn - FRAME_BASE)->private = private;
+}
+
+void *page_frame_private(uint64_t ppn)
+{
+	struct frame_chunk *chunk = chunk_of(ppn - FRAME_BASE);
+
+	return chunk ? chunk->frames[(ppn - FRAME_BASE) & (CHUNK_FRAMES - 1)].private : NULL;
 }
 
 void *phys_to_virt(uint64_t phys_addr)
 {
-	uint64_t ppn = (phys_addr >> 12) - 0xbaaaaaad;
+	uint64_t idx = (phys_addr >> 12) - FRAME_BASE;
 	uint64_t off = phys_addr & 0xfff;
+	struct frame_chunk *chunk = chunk_of(idx);
 	char *va = NULL;
 
-	if (ppn < NPAGES)
-		va = pages[ppn] + off;
+	if (chunk != NULL)
+		va = chunk->va + (idx & (CHUNK_FRAMES - 1)) * 4096 + off;
 
 	return va;
 }
 
+#ifndef OS_NO_SELFTEST
+
+static uint64_t frames_in_use(void)
+{
+	struct frame_stats stats;
+
+	page_frame_stats(&stats);
+	return stats.total - stats.free;
+}
+
+struct counting_handler {
+	struct pt_fault_handler handler;
+	uint64_t calls;
+	uint64_t limit;		/* vpns at or above this are refused */
+};
+
+static uint64_t counting_fault(struct pt_fault_handler *handler, uint64_t pt, uint64_t vpn)
+{
+	struct counting_handler *counting = (struct counting_handler *)handler;
+
+	(void)pt;
+	counting->calls++;
+	if (vpn >= counting->limit)
+		return NO_MAPPING;
+	return vpn + 0x9000;
+}
+
+struct ptl_test_thread {
+	pthread_t thread;
+	enum ptl_mode mode;
+	uint64_t pt;
+	uint64_t id;
+};
+
+#define PTL_TEST_THREADS	4
+#define PTL_TEST_PAGES		4096
+
+/* threads interleave their vpns so they race on the same tables */
+static void *ptl_test_run(void *arg)
+{
+	struct ptl_test_thread *t = arg;
+
+	for (uint64_t i = 0; i < PTL_TEST_PAGES; i++) {
+		uint64_t vpn = (i * PTL_TEST_THREADS + t->id) << 9;
+
+		ptl_update(t->mode, t->pt, vpn, vpn + 1);
+		if (ptl_query(t->mode, t->pt, vpn) != vpn + 1)
+			return arg;
+		if (i % 2)
+			ptl_update(t->mode, t->pt, vpn, NO_MAPPING);
+	}
+	return NULL;
+}
+
+struct swap_test_thread {
+	pthread_t thread;
+	struct pt_fault_handler *handler;
+	uint64_t pt;
+	uint64_t vpn;
+	uint64_t ppn;
+};
+
+static void *swap_test_run(void *arg)
+{
+	struct swap_test_thread *t = arg;
+
+	t->ppn = t->handler->fault(t->handler, t->pt, t->vpn);
+	return NULL;
+}
+
+static int count_pte(uint64_t vpn, uint64_t *pte, void *arg)
+{
+	(void)vpn;
+	(void)pte;
+	(*(uint64_t *)arg)++;
+	return 0;
+}
+
+static struct pt_usage usage_of(uint64_t pt)
+{
+	struct pt_usage usage = { 0, 0, 0 };
+
+	page_table_usage(pt, &usage);
+	return usage;
+}
+
+/* usage must match a full recount: mapped pages by walking, tables by frames in use */
+static int usage_matches(uint64_t pt, uint64_t frames_before)
+{
+	struct pt_usage usage;
+	uint64_t pages = 0;
+
+	page_table_walk(pt, 0, 1ULL << 45, count_pte, &pages);
+	return page_table_usage(pt, &usage) == 0 && usage.pages == pages
+		&& usage.tables + usage.leaf_tables == frames_in_use() - frames_before;
+}
+
+struct numa_test_thread {
+	pthread_t thread;
+	struct numa_pt *npt;
+	unsigned int node;
+};
+
+/* each node maps its own range and checks the other node's as it goes */
+static void *numa_test_run(void *arg)
+{
+	struct numa_test_thread *t = arg;
+	uint64_t base = 0x100000 * (t->node + 1);
+
+	for (uint64_t i = 0; i < 3000; i++) {
+		numa_pt_update(t->npt, t->node, base + i, base + i + 7);
+		if (numa_pt_query(t->npt, t->node, base + i) != base + i + 7)
+			return arg;
+		numa_pt_query(t->npt, t->node, 0x100000 * (2 - t->node) + i);
+	}
+	return NULL;
+}
+
+/* tables below this one whose frame does not directly follow the table before */
+static uint64_t dfs_order_breaks(uint64_t *table, int level, uint64_t *prev)
+{
+	uint64_t breaks = 0;
+
+	for (int i = 0; level < 4 && i < 512; i++) {
+		uint64_t ppn = table[i] >> 12;
+
+		if (!(table[i] & 1) || table[i] == NO_MAPPING)
+			continue;
+		breaks += ppn != *prev + 1;
+		*prev = ppn;
+		breaks += dfs_order_breaks(phys_to_virt(ppn << 12), level + 1, prev);
+	}
+	return breaks;
+}
+
 int main(int argc, char **argv)
 {
 	uint64_t pt = alloc_page_frame();
@@ -66,6 +577,7 @@ int main(int argc, char **argv)
 	pt = alloc_page_frame();
 	uint64_t new_pt = alloc_page_frame();
 	uint64_t *tmp;
+	uint64_t cpt_frames;
 
 	/* 1st Test */
 	assert(page_table_query(pt, 0xcafe) == NO_MAPPING);
@@ -250,7 +762,1247 @@ int main(int argc, char **argv)
 	page_table_update(new_pt, 0xabc, NO_MAPPING);
 	printf("zero_not_node_root_Test: PASSED\n");
 
+	// page_table_build_Test
+	{
+		static struct pt_mapping maps[1536 + 2];
+		size_t n = 0;
+
+		for (uint64_t i = 0; i < 1536; i++) {
+			maps[n].vpn = i;
+			maps[n++].ppn = i + 0x3000;
+		}
+		maps[n].vpn = 0x1ffff8000000;
+		maps[n++].ppn = 0x1212;
+		maps[n].vpn = 0x8fffff000000;
+		maps[n++].ppn = 0x3434;
+
+		pt = alloc_page_frame();
+		page_table_build(pt, maps, n);
+		for (size_t i = 0; i < n; i++)
+			assert(page_table_query(pt, maps[i].vpn) == maps[i].ppn);
+		assert(page_table_query(pt, 1536) == NO_MAPPING);
+		assert(page_table_query(pt, 0x1ffff8000001) == NO_MAPPING);
+
+		/* leaf tables of one subtree are allocated back to back */
+		tmp = phys_to_virt(pt << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		assert((tmp[1] >> 12) == (tmp[0] >> 12) + 1);
+		assert((tmp[2] >> 12) == (tmp[1] >> 12) + 1);
+
+		/* building on top of existing tables keeps earlier mappings */
+		maps[0].vpn = 0x1ffff8000001;
+		maps[0].ppn = 0x5656;
+		page_table_build(pt, maps, 1);
+		assert(page_table_query(pt, 0x1ffff8000000) == 0x1212);
+		assert(page_table_query(pt, 0x1ffff8000001) == 0x5656);
+	}
+	printf("page_table_build_Test: PASSED\n");
+	page_table_destroy(pt);
+
+	// page_table_destroy_Test
+	{
+		uint64_t frames[1 + 1 + 1 + 64 + 64];
+		struct frame_stats stats;
+		uint64_t before;
+
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < 64; i++) {
+			page_table_update(pt, i << 18, i);
+			page_table_update(pt, (i << 18) | 0x1ff, i);
+		}
+		before = frames_in_use();
+		page_table_destroy(pt);
+		assert(frames_in_use() == before - sizeof(frames) / sizeof(frames[0]));
+
+		/* every table frame comes back zeroed without growing memory */
+		page_frame_stats(&stats);
+		before = stats.total;
+		for (int i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+			frames[i] = alloc_page_frame();
+			tmp = phys_to_virt(frames[i] << 12);
+			for (int j = 0; j < 512; j++)
+				assert(tmp[j] == 0);
+		}
+		page_frame_stats(&stats);
+		assert(stats.total == before);
+
+		for (int i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+			free_page_frame(frames[i]);
+	}
+	printf("page_table_destroy_Test: PASSED\n");
+
+	// cpt_Test: isolated addresses cost no tables below the root
+	cpt_frames = frames_in_use();
+	pt = alloc_page_frame();
+	for (int i = 0; i < sizeof(large_addrs) / sizeof(large_addrs[0]); i++) {
+		cpt_update(pt, large_addrs[i], large_addrs[i] >> 12);
+		assert(cpt_query(pt, large_addrs[i]) == (large_addrs[i] >> 12));
+		assert(cpt_query(pt, large_addrs[i] + 1) == NO_MAPPING);
+		tmp = phys_to_virt(pt << 12);
+		assert((tmp[(large_addrs[i] >> 36) & 0x1ff] & 3) == 3);
+	}
+	cpt_update(pt, 0x1ffff8000001, 0x1313);
+	cpt_update(pt, 0x1fff00000000, 0x1414);
+	assert(cpt_query(pt, 0x1ffff8000000) == 0x1ffff8000);
+	assert(cpt_query(pt, 0x1ffff8000001) == 0x1313);
+	assert(cpt_query(pt, 0x1fff00000000) == 0x1414);
+	cpt_update(pt, 0x1ffff8000001, NO_MAPPING);
+	cpt_update(pt, 0x1fff00000000, NO_MAPPING);
+	assert(cpt_query(pt, 0x1ffff8000001) == NO_MAPPING);
+	assert(cpt_query(pt, 0x1ffff8000000) == 0x1ffff8000);
+	assert((tmp[(0x1ffff8000000 >> 36) & 0x1ff] & 3) == 3);
+	for (int i = 0; i < sizeof(large_addrs) / sizeof(large_addrs[0]); i++) {
+		cpt_update(pt, large_addrs[i], NO_MAPPING);
+		assert(cpt_query(pt, large_addrs[i]) == NO_MAPPING);
+	}
+	for (int i = 0; i < 512; i++)
+		assert(tmp[i] == 0);
+
+	// cpt_Test: agrees with the plain page table on a random workload
+	new_pt = alloc_page_frame();
+	{
+		uint64_t seed = 0x2545f4914f6cdd1d;
+		uint64_t vpn;
+
+		for (int i = 0; i < 20000; i++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			vpn = (seed >> 19) & ((1ULL << 45) - 1);
+			/* keep the vpns clustered so tables get shared and split */
+			vpn &= (seed & 1) ? 0x1ff0000ffff : 0x00000001fff;
+			if ((seed >> 8) % 4 == 0) {
+				cpt_update(pt, vpn, NO_MAPPING);
+				if (page_table_query(new_pt, vpn) != NO_MAPPING)
+					page_table_update(new_pt, vpn, NO_MAPPING);
+			} else {
+				cpt_update(pt, vpn, seed >> 40);
+				page_table_update(new_pt, vpn, seed >> 40);
+			}
+			assert(cpt_query(pt, vpn) == page_table_query(new_pt, vpn));
+			assert(cpt_query(pt, vpn ^ 1) == page_table_query(new_pt, vpn ^ 1));
+		}
+	}
+	cpt_destroy(pt);
+	page_table_destroy(new_pt);
+	/* node pool frames go back to the allocator with their last node */
+	assert(frames_in_use() == cpt_frames);
+	printf("cpt_Test: PASSED\n");
+
+	// page_table_freeze_Test
+	{
+		struct pt_frozen *frozen;
+		uint64_t seed = 0x9e3779b97f4a7c15;
+		uint64_t vpn;
+
+		pt = alloc_page_frame();
+		frozen = page_table_freeze(pt);
+		assert(page_table_frozen_query(frozen, 0) == NO_MAPPING);
+		page_table_frozen_free(frozen);
+
+		for (uint64_t i = 0; i < 3000; i++)
+			page_table_update(pt, 0x1000 + i, 0x7000 + i);
+		for (uint64_t i = 0; i < 700; i++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			page_table_update(pt, (seed >> 20) & ((1ULL << 45) - 1), seed >> 44);
+		}
+		for (int i = 0; i < sizeof(large_addrs) / sizeof(large_addrs[0]); i++)
+			page_table_update(pt, large_addrs[i], i);
+		/* an entry with its valid bit cleared is not mapped */
+		tmp = phys_to_virt(pt << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[8] >> 12) << 12);
+		tmp[5] &= ~1ULL;
+
+		frozen = page_table_freeze(pt);
+		for (uint64_t i = 0; i < 3100; i++)
+			assert(page_table_frozen_query(frozen, 0xfc0 + i) == page_table_query(pt, 0xfc0 + i));
+		for (int i = 0; i < sizeof(large_addrs) / sizeof(large_addrs[0]); i++)
+			assert(page_table_frozen_query(frozen, large_addrs[i]) == i);
+		seed = 0x9e3779b97f4a7c15;
+		for (uint64_t i = 0; i < 700; i++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			vpn = (seed >> 20) & ((1ULL << 45) - 1);
+			assert(page_table_frozen_query(frozen, vpn) == page_table_query(pt, vpn));
+			assert(page_table_frozen_query(frozen, vpn + 1) == page_table_query(pt, vpn + 1));
+		}
+		page_table_frozen_free(frozen);
+		page_table_destroy(pt);
+	}
+	printf("page_table_freeze_Test: PASSED\n");
+
+	// vm_read_write_Test: a buffer across a leaf table boundary
+	{
+		static unsigned char in[32 * 4096], out[32 * 4096];
+
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < 32; i++)
+			page_table_update(pt, 0x5f0 + i, alloc_page_frame());
+		for (int i = 0; i < sizeof(in); i++)
+			in[i] = i * 7 + (i >> 12);
+
+		assert(vm_write(pt, (0x5f0 << 12) + 100, in, sizeof(in) - 100) == 0);
+		assert(vm_read(pt, (0x5f0 << 12) + 100, out, sizeof(out) - 100) == 0);
+		assert(memcmp(in, out, sizeof(in) - 100) == 0);
+		tmp = phys_to_virt(page_table_query(pt, 0x600) << 12);
+		assert(memcmp(tmp, in + 16 * 4096 - 100, 4096) == 0);
+
+		/* copies stop at the first unmapped page */
+		page_table_update(pt, 0x601, NO_MAPPING);
+		memset(out, 0, sizeof(out));
+		assert(vm_read(pt, 0x5ff << 12, out, 4 * 4096) == 2 * 4096);
+		assert(memcmp(out, in + 15 * 4096 - 100, 2 * 4096) == 0);
+		assert(vm_write(pt, 0x620 << 12, in, 1) == 1);
+		assert(vm_read(pt, (0x5f0 << 12) + 5, out, 0) == 0);
+		page_table_destroy(pt);
+	}
+	printf("vm_read_write_Test: PASSED\n");
+
+	// vm_load_store_Test
+	{
+		static struct vm_mmu mmu;
+		uint64_t base = 0x1ff000;
+
+		pt = alloc_page_frame();
+		page_table_update(pt, base >> 12, alloc_page_frame());
+		page_table_update(pt, (base >> 12) + 1, alloc_page_frame());
+		vm_mmu_init(&mmu, pt);
+
+		vm_store64(&mmu, base + 8, 0x1122334455667788);
+		assert(vm_load64(&mmu, base + 8) == 0x1122334455667788);
+		assert(vm_load32(&mmu, base + 8) == 0x55667788);
+		assert(vm_load16(&mmu, base + 14) == 0x1122);
+		assert(vm_load8(&mmu, base + 9) == 0x77);
+		assert(vm_load32(&mmu, base + 9) == 0x44556677);
+
+		/* page crossing accesses go through both pages */
+		vm_store64(&mmu, base + 4092, 0xa1a2a3a4b1b2b3b4);
+		assert(vm_load64(&mmu, base + 4092) == 0xa1a2a3a4b1b2b3b4);
+		assert(vm_load32(&mmu, base + 4096) == 0xa1a2a3a4);
+		{
+			unsigned char bytes[8];
+			assert(vm_read(pt, base + 4092, bytes, 8) == 0);
+			assert(bytes[0] == 0xb4 && bytes[7] == 0xa1);
+		}
+		assert(!mmu.fault);
+
+		/* unmapped pages fault, and flushing drops stale translations */
+		assert(vm_load8(&mmu, base + 2 * 4096) == 0);
+		assert(mmu.fault && mmu.fault_vaddr == base + 2 * 4096);
+		mmu.fault = 0;
+		vm_store16(&mmu, base + 2 * 4096 - 1, 0xffff);
+		assert(mmu.fault && vm_load8(&mmu, base + 2 * 4096 - 1) == 0);
+		mmu.fault = 0;
+		page_table_update(pt, base >> 12, NO_MAPPING);
+		assert(vm_load64(&mmu, base + 8) == 0x1122334455667788);
+		vm_tlb_flush_page(&mmu, base >> 12);
+		assert(vm_load64(&mmu, base + 8) == 0 && mmu.fault);
+		page_table_destroy(pt);
+	}
+	printf("vm_load_store_Test: PASSED\n");
+
+	// nested_paging_Test
+	{
+		static struct nested_mmu mmu;
+		uint64_t data, refs, hits;
+
+		pt = alloc_page_frame();
+		nested_init(&mmu, pt);
+		data = nested_alloc_guest_frame(&mmu);
+		nested_guest_update(&mmu, 0xcafe, data);
+		nested_guest_update(&mmu, 0xcaff, data);
+
+		/* no caches: 5 guest entries, 6 host walks of 5 entries each */
+		mmu.use_tlb = mmu.use_nwc = 0;
+		refs = mmu.stats.memory_refs;
+		assert(nested_query(&mmu, 0xcafe) == page_table_query(pt, data));
+		assert(mmu.stats.memory_refs - refs == 5 + 6 * 5);
+
+		/* the walk cache leaves only the final host walk */
+		mmu.use_nwc = 1;
+		assert(nested_query(&mmu, 0xcafe) == page_table_query(pt, data));
+		refs = mmu.stats.memory_refs;
+		assert(nested_query(&mmu, 0xcaff) == page_table_query(pt, data));
+		assert(mmu.stats.memory_refs - refs == 5 + 5);
+
+		/* and the nested TLB skips both dimensions */
+		mmu.use_tlb = 1;
+		assert(nested_query(&mmu, 0xcafe) == page_table_query(pt, data));
+		refs = mmu.stats.memory_refs;
+		hits = mmu.stats.tlb_hits;
+		assert(nested_query(&mmu, 0xcaff) == page_table_query(pt, data));
+		assert(mmu.stats.memory_refs == refs && mmu.stats.tlb_hits == hits + 1);
+
+		nested_guest_update(&mmu, 0xcafe, NO_MAPPING);
+		assert(nested_query(&mmu, 0xcafe) == NO_MAPPING);
+		assert(nested_query(&mmu, 0xbeef) == NO_MAPPING);
+		page_table_destroy(pt);
+	}
+	printf("nested_paging_Test: PASSED\n");
+
+	// page_table_query_or_fault_Test
+	{
+		struct counting_handler counting = {{counting_fault, 16}, 0, 0x1000 + 40};
+		uint64_t faults = 0;
+
+		pt = alloc_page_frame();
+		page_table_update(pt, 0x1003, 0x3);
+		for (uint64_t vpn = 0x1000; vpn < 0x1000 + 64; vpn++) {
+			uint64_t mapped = page_table_query(pt, vpn) != NO_MAPPING;
+			uint64_t ppn = page_table_query_or_fault(pt, vpn, &counting.handler);
+
+			faults += !mapped;
+			if (vpn == 0x1003)
+				assert(ppn == 0x3);
+			else if (vpn < counting.limit)
+				assert(ppn == vpn + 0x9000);
+			else
+				assert(ppn == NO_MAPPING);
+		}
+		/* one fault per 16 pages, then one per refused page */
+		assert(faults == 3 + 24);
+		assert(counting.calls == 15 + 16 + 16 + 24);
+
+		/* the window stays inside the faulting vpn's leaf table */
+		counting.handler.fault_around = 1024;
+		counting.limit = NO_MAPPING;
+		page_table_query_or_fault(pt, 0x2000 + 511, &counting.handler);
+		assert(page_table_query(pt, 0x2000) == 0x2000 + 0x9000);
+		assert(page_table_query(pt, 0x2000 + 512) == NO_MAPPING);
+		page_table_destroy(pt);
+	}
+	printf("page_table_query_or_fault_Test: PASSED\n");
+
+	// page_table_protect_range_Test
+	{
+		static struct vm_mmu mmu;
+		unsigned char byte = 0x5a;
+
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < 8; i++)
+			page_table_update(pt, 0x1fc + i, alloc_page_frame());
+		page_table_update(pt, 0x10000, 0x77);
+		assert(page_table_query_pte(pt, 0x1fc) == ((page_table_query(pt, 0x1fc) << 12) | PTE_VALID | PTE_PROT));
+		assert(page_table_query_pte(pt, 0x1fc + 8) == 0);
+		assert(page_table_query_pte(pt, 0xcafe000) == 0);
+
+		/* spans two leaf tables, a hole and an unpopulated subtree */
+		assert(page_table_protect_range(pt, 0x1fd, 0x20000, PTE_READ | PTE_USER) == 7 + 1);
+		assert(page_table_protect_range(pt, 0x1fd, 0x20000, PTE_READ | PTE_USER) == 0);
+		assert((page_table_query_pte(pt, 0x1fc) & PTE_PROT) == PTE_PROT);
+		assert((page_table_query_pte(pt, 0x200) & PTE_PROT) == (PTE_READ | PTE_USER));
+		assert(page_table_query(pt, 0x10000) == 0x77);
+
+		/* the software MMU honours the permissions */
+		vm_mmu_init(&mmu, pt);
+		vm_store8(&mmu, 0x200 << 12, 1);
+		assert(mmu.fault && vm_load8(&mmu, 0x200 << 12) == 0);
+		assert(vm_write(pt, 0x1fc << 12, &byte, 1) == 0);
+		assert(vm_write(pt, 0x1fd << 12, &byte, 1) == 1);
+		page_table_protect_range(pt, 0x1fd, 1, 0);
+		assert(vm_read(pt, 0x1fd << 12, &byte, 1) == 1);
+		page_table_protect_range(pt, 0x1fd, 7, PTE_PROT);
+		mmu.fault = 0;
+		vm_tlb_flush(&mmu);
+		vm_store8(&mmu, 0x200 << 12, 1);
+		assert(!mmu.fault && vm_load8(&mmu, 0x200 << 12) == 1);
+		page_table_destroy(pt);
+	}
+	printf("page_table_protect_range_Test: PASSED\n");
+
+	// page_table_move_range_Test
+	{
+		static struct pt_mapping maps[512 * 512];
+		uint64_t *moved, before;
+
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < 512 * 512; i++) {
+			maps[i].vpn = (1ULL << 18) + i;
+			maps[i].ppn = i;
+		}
+		page_table_build(pt, maps, 512 * 512);
+		page_table_update(pt, (3ULL << 18) + 5, 0xdead);
+
+		/* a 1 GiB region moves by relinking one entry, no new tables */
+		tmp = phys_to_virt(pt << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		moved = phys_to_virt((tmp[1] >> 12) << 12);
+		before = frames_in_use();
+		page_table_move_range(pt, 1ULL << 18, 3ULL << 18, 512 * 512);
+		assert(frames_in_use() == before - 2);
+		assert(phys_to_virt((tmp[3] >> 12) << 12) == moved && tmp[1] == 0);
+		for (uint64_t i = 0; i < 512 * 512; i += 511) {
+			assert(page_table_query(pt, (1ULL << 18) + i) == NO_MAPPING);
+			assert(page_table_query(pt, (3ULL << 18) + i) == i);
+		}
+		assert(page_table_query(pt, (3ULL << 18) + 5) == 5);
+
+		/* unaligned moves copy entries and clear the holes they carry */
+		page_table_update(pt, 0x1000 + 3, 0x33);
+		page_table_update(pt, 0x1000 + 700, 0x44);
+		page_table_update(pt, 0x8000 + 10, 0x55);
+		page_table_move_range(pt, 0x1000 + 3, 0x8000 + 7, 1000);
+		assert(page_table_query(pt, 0x8000 + 7) == 0x33);
+		assert(page_table_query(pt, 0x8000 + 704) == 0x44);
+		assert(page_table_query(pt, 0x8000 + 10) == NO_MAPPING);
+		assert(page_table_query(pt, 0x1000 + 3) == NO_MAPPING);
+		assert(page_table_query(pt, 0x1000 + 700) == NO_MAPPING);
+
+		/* a moved hole leaves nothing behind at an aligned destination */
+		page_table_update(pt, 0x20000, 0x66);
+		page_table_move_range(pt, 0x40000, 0x20000, 512);
+		assert(page_table_query(pt, 0x20000) == NO_MAPPING);
+		page_table_destroy(pt);
+	}
+	printf("page_table_move_range_Test: PASSED\n");
+
+	// page_table_unmap_range_Test
+	{
+		uint64_t before;
+
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < 2048; i++)
+			page_table_update(pt, i, i + 0x2000);
+		page_table_update(pt, 0x1ffff8000000, 0x1212);
+
+		/* clears the edges entry by entry, and whole tables in between */
+		page_table_unmap_range(pt, 3, 2040);
+		assert(page_table_query(pt, 2) == 0x2002);
+		assert(page_table_query(pt, 3) == NO_MAPPING);
+		assert(page_table_query(pt, 1000) == NO_MAPPING);
+		assert(page_table_query(pt, 2042) == NO_MAPPING);
+		assert(page_table_query(pt, 2043) == 2043 + 0x2000);
+		tmp = phys_to_virt(pt << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		assert(tmp[0] != 0 && tmp[1] == 0 && tmp[2] == 0 && tmp[3] != 0);
+
+		/* the freed tables are reused */
+		before = frames_in_use();
+		page_table_update(pt, 600, 0x600);
+		page_table_update(pt, 1100, 0x1100);
+		assert(frames_in_use() == before + 2);
+
+		/* emptied tables are freed all the way up to the root */
+		page_table_unmap_range(pt, 0, 1ULL << 45);
+		tmp = phys_to_virt(pt << 12);
+		for (int i = 0; i < 512; i++)
+			assert(tmp[i] == 0);
+		page_table_destroy(pt);
+	}
+	printf("page_table_unmap_range_Test: PASSED\n");
+
+	// buddy_allocator_Test
+	{
+		static struct pt_mapping maps[1536];
+		struct frame_stats baseline, stats;
+		uint64_t block, run;
+		char *va;
+
+		page_frame_stats(&baseline);
+
+		/* contiguous, aligned, and contiguous in host memory too */
+		block = alloc_page_frames(3);
+		assert(block % 8 == 0);
+		va = phys_to_virt(block << 12);
+		for (int i = 0; i < 8; i++) {
+			assert(phys_to_virt((block + i) << 12) == va + i * 4096);
+			va[i * 4096] = 1;
+		}
+		free_page_frames(block, 3);
+		block = alloc_page_frames(FRAME_MAX_ORDER);
+		assert(block % (1 << FRAME_MAX_ORDER) == 0);
+		va = phys_to_virt(block << 12);
+		for (int i = 0; i < 8; i++)
+			assert(va[i * 4096] == 0);
+		free_page_frames(block, FRAME_MAX_ORDER);
+
+		/* freeing every other frame fragments, freeing the rest coalesces */
+		run = alloc_page_frames(6);
+		for (int i = 0; i < 64; i += 2)
+			free_page_frame(run + i);
+		page_frame_stats(&stats);
+		assert(stats.free == baseline.free - 32);
+		assert(stats.free_blocks[0] == baseline.free_blocks[0] + 32);
+		assert(stats.unusable[1] > baseline.unusable[1]);
+
+		/* the builder still lays out a subtree in one run */
+		for (uint64_t i = 0; i < 1536; i++) {
+			maps[i].vpn = i;
+			maps[i].ppn = i;
+		}
+		pt = alloc_page_frame();
+		page_table_build(pt, maps, 1536);
+		tmp = phys_to_virt(pt << 12);
+		block = tmp[0] >> 12;
+		for (int level = 1; level < 4; level++) {
+			tmp = phys_to_virt((tmp[0] >> 12) << 12);
+			assert((tmp[0] >> 12) == block + level);
+		}
+		assert((tmp[1] >> 12) == block + 4 && (tmp[2] >> 12) == block + 5);
+		page_table_destroy(pt);
+
+		for (int i = 1; i < 64; i += 2)
+			free_page_frame(run + i);
+		page_frame_stats(&stats);
+		assert(stats.total == baseline.total && stats.free == baseline.free);
+		for (int k = 0; k <= FRAME_MAX_ORDER; k++)
+			assert(stats.free_blocks[k] == baseline.free_blocks[k]);
+	}
+	printf("buddy_allocator_Test: PASSED\n");
+
+	// growable_memory_Test
+	{
+		/* more than the old fixed 2^20 frames */
+		enum { nblocks = 1100 };
+		static uint64_t blocks[nblocks];
+		struct frame_stats baseline, stats;
+		char *va;
+
+		page_frame_stats(&baseline);
+		for (int i = 0; i < nblocks; i++)
+			blocks[i] = alloc_page_frames(FRAME_MAX_ORDER);
+		page_frame_stats(&stats);
+		assert(stats.total >= (uint64_t)nblocks << FRAME_MAX_ORDER);
+		assert(stats.total > 1024 * 1024);
+
+		va = phys_to_virt((blocks[nblocks - 1] + 1023) << 12);
+		assert(va != NULL);
+		va[4095] = 7;
+
+		for (int i = 0; i < nblocks; i++)
+			free_page_frames(blocks[i], FRAME_MAX_ORDER);
+		page_frame_stats(&stats);
+		assert(stats.total - stats.free == baseline.total - baseline.free);
+
+		/* nowhere near any frame */
+		assert(phys_to_virt(0x1000) == NULL);
+		assert(phys_to_virt(~0ULL << 12) == NULL);
+	}
+	printf("growable_memory_Test: PASSED\n");
+
+	// ptl_Test
+	{
+		enum ptl_mode modes[] = { PTL_GLOBAL, PTL_CAS, PTL_SPLIT };
+		struct ptl_test_thread threads[PTL_TEST_THREADS];
+
+		for (int m = 0; m < 3; m++) {
+			pt = alloc_page_frame();
+			for (int i = 0; i < PTL_TEST_THREADS; i++) {
+				threads[i] = (struct ptl_test_thread){ .mode = modes[m], .pt = pt, .id = i };
+				assert(pthread_create(&threads[i].thread, NULL, ptl_test_run, &threads[i]) == 0);
+			}
+			for (int i = 0; i < PTL_TEST_THREADS; i++) {
+				void *failed;
+
+				pthread_join(threads[i].thread, &failed);
+				assert(failed == NULL);
+			}
+
+			for (uint64_t vpn = 0; vpn < PTL_TEST_THREADS * PTL_TEST_PAGES; vpn++) {
+				uint64_t expected = (vpn / PTL_TEST_THREADS) % 2 ? NO_MAPPING : (vpn << 9) + 1;
+
+				assert(ptl_query(modes[m], pt, vpn << 9) == expected);
+				assert(page_table_query(pt, vpn << 9) == expected);
+			}
+			ptl_update(modes[m], pt, 0x1234567, NO_MAPPING);
+			assert(page_table_query_pte(pt, 0x1234567) == 0);
+
+			/* a remap writes a fresh entry, as page_table_update does */
+			page_table_protect_range(pt, 0, 1, PTE_READ);
+			ptl_update(modes[m], pt, 0, 0x77);
+			page_table_update(pt, 1, 0x77);
+			assert(page_table_query_pte(pt, 0) == page_table_query_pte(pt, 1));
+			assert(page_table_query_pte(pt, 0) == ((0x77 << 12) | PTE_VALID | PTE_PROT));
+			page_table_destroy(pt);
+		}
+	}
+	printf("ptl_Test: PASSED\n");
+
+	// wss_Test
+	{
+		static struct vm_mmu mmu;
+		struct wss_tracker *tracker;
+		struct wss_report report;
+		uint64_t bitmap[2];
+
+		pt = alloc_page_frame();
+		for (uint64_t vpn = 0x300; vpn < 0x340; vpn++)
+			page_table_update(pt, vpn, alloc_page_frame());
+		vm_mmu_init(&mmu, pt);
+
+		/* idle page tracking: only pages touched since marking are busy */
+		assert(wss_mark_idle(pt, 0x300, 0x80) == 0x40);
+		vm_store8(&mmu, 0x305000, 1);
+		vm_load8(&mmu, 0x33f000);
+		assert(page_table_query_pte(pt, 0x305) & PTE_ACCESSED);
+		assert(wss_read_idle(pt, 0x300, 0x80, bitmap) == 0x3e);
+		assert(bitmap[0] == ~(1ULL << 5 | 1ULL << 63) && bitmap[1] == 0);
+
+		/* a TLB hit does not set the bit again */
+		wss_mark_idle(pt, 0x300, 0x40);
+		vm_load8(&mmu, 0x305000);
+		assert(!(page_table_query_pte(pt, 0x305) & PTE_ACCESSED));
+
+		/* 16 pages touched every interval, 16 only in the first, the rest never */
+		tracker = wss_create(pt, 0x300, 0x40, 4);
+		for (int sample = 0; sample < 3; sample++) {
+			vm_tlb_flush(&mmu);
+			for (uint64_t vpn = 0x300; vpn < 0x310; vpn++)
+				vm_load8(&mmu, vpn << 12);
+			for (uint64_t vpn = 0x310; sample == 0 && vpn < 0x320; vpn++)
+				vm_load8(&mmu, vpn << 12);
+			wss_sample(tracker);
+		}
+		wss_report(tracker, &report);
+		assert(report.samples == 3);
+		assert(report.hot == 16 && report.warm == 16 && report.cold == 32);
+		assert(report.age[0] == 16 && report.age[2] == 16 && report.age[4] == 32);
+
+		/* unmapped pages drop out, and warm pages age out of the window */
+		page_table_update(pt, 0x300, NO_MAPPING);
+		for (int sample = 0; sample < 2; sample++)
+			wss_sample(tracker);
+		wss_report(tracker, &report);
+		assert(report.hot == 0 && report.warm == 15 && report.cold == 48);
+		wss_destroy(tracker);
+		page_table_destroy(pt);
+	}
+	printf("wss_Test: PASSED\n");
+
+	// swap_Test
+	{
+		struct counting_handler fallback = { { counting_fault, 0 }, 0, NO_MAPPING };
+		struct pt_fault_handler *handler;
+		struct swap_device *swap;
+		struct swap_stats stats;
+		char path[] = "/tmp/hw1-swap-XXXXXX";
+		uint64_t before, pte;
+		int fd = mkstemp(path);
+
+		assert(fd >= 0);
+		close(fd);
+
+		pt = alloc_page_frame();
+		for (uint64_t vpn = 0x500; vpn < 0x540; vpn++) {
+			page_table_update(pt, vpn, alloc_page_frame());
+			*(uint64_t *)phys_to_virt(page_table_query(pt, vpn) << 12) = vpn * 3;
+		}
+		page_table_protect_range(pt, 0x507, 1, PTE_READ);
+
+		swap = swap_open(path, 128, 8, &fallback.handler);
+		handler = swap_fault_handler(swap);
+		before = frames_in_use();
+		for (uint64_t vpn = 0x500; vpn < 0x540; vpn++)
+			assert(swap_out(swap, pt, vpn) == 0);
+		assert(swap_out(swap, pt, 0x500) == -1);
+		assert(frames_in_use() == before - 0x40);
+
+		pte = page_table_query_pte(pt, 0x507);
+		assert(pte_is_swap(pte) && (pte & PTE_PROT) == PTE_READ);
+		assert(page_table_query(pt, 0x507) == NO_MAPPING);
+
+		/* sequential faults are served by readahead */
+		for (uint64_t vpn = 0x500; vpn < 0x540; vpn++) {
+			uint64_t ppn = page_table_query_or_fault(pt, vpn, handler);
+
+			assert(ppn != NO_MAPPING);
+			assert(*(uint64_t *)phys_to_virt(ppn << 12) == vpn * 3);
+		}
+		assert((page_table_query_pte(pt, 0x507) & PTE_PROT) == PTE_READ);
+		assert((page_table_query_pte(pt, 0x508) & PTE_PROT) == PTE_PROT);
+		assert(frames_in_use() == before);
+
+		swap_get_stats(swap, &stats);
+		assert(stats.swap_outs == 0x40 && stats.swap_ins == 0x40 && stats.slots_used == 0);
+		assert(stats.readahead_hits > 0 && stats.readahead_hits <= stats.readahead_reads);
+		assert(stats.bytes_written == 0x40 * 4096 && stats.bytes_read == 0x40 * 4096);
+
+		/* a swapped-out page keeps its slot when moved between leaf offsets */
+		assert(swap_out(swap, pt, 0x510) == 0);
+		page_table_move_range(pt, 0x50e, 0x70003, 4);
+		assert(page_table_query_pte(pt, 0x510) == 0);
+		assert(pte_is_swap(page_table_query_pte(pt, 0x70005)));
+		pte = page_table_query_or_fault(pt, 0x70005, handler);
+		assert(*(uint64_t *)phys_to_virt(pte << 12) == 0x510 * 3);
+		swap_get_stats(swap, &stats);
+		assert(stats.slots_used == 0);
+
+		/* two faults on one swapped-out page read it in once and agree on the frame */
+		before = frames_in_use();
+		for (int round = 0; round < 100; round++) {
+			struct swap_test_thread threads[2];
+			uint64_t swap_ins;
+
+			assert(swap_out(swap, pt, 0x520) == 0);
+			swap_get_stats(swap, &stats);
+			swap_ins = stats.swap_ins;
+			for (int i = 0; i < 2; i++) {
+				threads[i] = (struct swap_test_thread){ .handler = handler, .pt = pt, .vpn = 0x520 };
+				assert(pthread_create(&threads[i].thread, NULL, swap_test_run, &threads[i]) == 0);
+			}
+			for (int i = 0; i < 2; i++)
+				pthread_join(threads[i].thread, NULL);
+
+			assert(threads[0].ppn == threads[1].ppn);
+			assert(page_table_query(pt, 0x520) == threads[0].ppn);
+			assert(*(uint64_t *)phys_to_virt(threads[0].ppn << 12) == 0x520 * 3);
+			swap_get_stats(swap, &stats);
+			assert(stats.swap_ins == swap_ins + 1 && stats.slots_used == 0);
+		}
+		assert(frames_in_use() == before);
+
+		/* protecting a swapped-out page sets the permissions it comes back with */
+		assert(swap_out(swap, pt, 0x521) == 0 && swap_out(swap, pt, 0x507) == 0);
+		assert(page_table_protect_range(pt, 0x521, 1, PTE_READ) == 1);
+		assert(page_table_protect_range(pt, 0x507, 1, PTE_PROT) == 1);
+		pte = page_table_query_pte(pt, 0x521);
+		assert(pte_is_swap(pte) && (pte & PTE_PROT) == PTE_READ);
+		assert(page_table_query_or_fault(pt, 0x521, handler) != NO_MAPPING);
+		assert(page_table_query_or_fault(pt, 0x507, handler) != NO_MAPPING);
+		assert((page_table_query_pte(pt, 0x521) & PTE_PROT) == PTE_READ);
+		assert((page_table_query_pte(pt, 0x507) & PTE_PROT) == PTE_PROT);
+
+		/* pages that were never swapped out go to the fallback */
+		assert(page_table_query_or_fault(pt, 0x600, handler) == 0x600 + 0x9000);
+		assert(fallback.calls == 1);
+
+		swap_close(swap);
+		unlink(path);
+		page_table_destroy(pt);
+	}
+	printf("swap_Test: PASSED\n");
+
+	// ksm_Test
+	{
+		static struct vm_mmu mmu;
+		struct ksm *ksm;
+		struct ksm_stats stats;
+		uint64_t roots[3], before, pte;
+
+		/* the same 16-page image in three roots, then 16 pages of private data */
+		for (int r = 0; r < 3; r++) {
+			roots[r] = alloc_page_frame();
+			for (uint64_t vpn = 0x700; vpn < 0x720; vpn++) {
+				page_table_update(roots[r], vpn, alloc_page_frame());
+				memset(phys_to_virt(page_table_query(roots[r], vpn) << 12),
+				       vpn < 0x710 ? (int)vpn : (int)(vpn + r * 0x20), 4096);
+			}
+		}
+
+		ksm = ksm_create();
+		for (int r = 0; r < 3; r++)
+			ksm_register(ksm, roots[r], 0x700, 0x20);
+
+		/* the first pass only takes checksums */
+		before = frames_in_use();
+		ksm_scan(ksm, 3 * 0x20);
+		ksm_get_stats(ksm, &stats);
+		assert(stats.pages_scanned == 0x60 && stats.pages_shared == 0);
+		ksm_scan(ksm, 3 * 0x20);
+		ksm_get_stats(ksm, &stats);
+		assert(stats.full_scans == 2);
+		assert(stats.pages_shared == 0x10 && stats.pages_sharing == 0x30 && stats.frames_freed == 0x20);
+		assert(frames_in_use() == before - 0x20);
+
+		for (uint64_t vpn = 0x700; vpn < 0x720; vpn++) {
+			pte = page_table_query_pte(roots[1], vpn);
+			assert(*(char *)phys_to_virt(pte & ~0xfffULL) == (char)(vpn < 0x710 ? vpn : vpn + 0x20));
+			assert((page_table_query(roots[0], vpn) == (pte >> 12)) == (vpn < 0x710));
+			assert(!(pte & PTE_WRITE) == (vpn < 0x710));
+		}
+
+		/* merged pages are copy-on-write, and ksm_unmerge copies ahead of time */
+		vm_mmu_init(&mmu, roots[2]);
+		assert(page_table_query_pte(roots[2], 0x703) & PTE_COW);
+		assert(ksm_unmerge(ksm, roots[2], 0x703) == 1);
+		assert(ksm_unmerge(ksm, roots[2], 0x713) == 0);
+		assert(page_table_query_pte(roots[2], 0x703) & PTE_WRITE);
+		vm_store8(&mmu, 0x703000, 1);
+		assert(!mmu.fault && vm_load8(&mmu, 0x703001) == 3);
+		assert(page_table_query(roots[2], 0x703) != page_table_query(roots[0], 0x703));
+		assert(frames_in_use() == before - 0x1f);
+
+		/* a write copies, even from the last page mapping the shared frame */
+		vm_store8(&mmu, 0x704000, 1);
+		assert(!mmu.fault && vm_load8(&mmu, 0x704001) == 4);
+		assert(*(char *)phys_to_virt(page_table_query(roots[0], 0x704) << 12) == 4);
+		assert(frames_in_use() == before - 0x1e);
+
+		/* the background scanner merges a page in a fourth root as well */
+		roots[0] = alloc_page_frame();
+		page_table_update(roots[0], 0x700, alloc_page_frame());
+		memset(phys_to_virt(page_table_query(roots[0], 0x700) << 12), 0x700, 4096);
+		ksm_register(ksm, roots[0], 0x700, 1);
+		ksm_start(ksm, 16, 1);
+		do {
+			ksm_get_stats(ksm, &stats);
+		} while (stats.pages_sharing < 0x30);
+		ksm_stop(ksm);
+		assert(stats.pages_shared == 0x10);
+		ksm_destroy(ksm);
+	}
+	printf("ksm_Test: PASSED\n");
+
+	// vma_Test
+	{
+		struct vma_space space;
+		struct vma *vma;
+		uint64_t before = frames_in_use(), ppn;
+
+		pt = alloc_page_frame();
+		vma_space_init(&space, pt, 0x10, 1ULL << 45);
+
+		/* a thousand one-page areas with one-page holes between them */
+		for (uint64_t i = 0; i < 1000; i++)
+			assert(vma_map(&space, 0x10 + 2 * i, 1, PTE_READ | PTE_WRITE) == 0x10 + 2 * i);
+		assert(space.count == 1000);
+		assert(vma_map(&space, 0x14, 1, PTE_READ) == NO_MAPPING);
+		assert(vma_map(&space, 0x8, 1, PTE_READ) == NO_MAPPING);
+		assert(vma_get_unmapped_area(&space, 1) == 0x11);
+		assert(vma_get_unmapped_area(&space, 2) == 0x10 + 1999);
+
+		/* unmapping three areas opens a 7-page hole, found before the tail */
+		vma_unmap(&space, 0x10 + 500, 6);
+		assert(space.count == 997);
+		assert(vma_get_unmapped_area(&space, 7) == 0x10 + 499);
+		assert(vma_map(&space, NO_MAPPING, 5, PTE_READ) == 0x10 + 499);
+		vma = vma_find(&space, 0x10 + 500);
+		assert(vma->start == 0x10 + 499 && vma->end == 0x10 + 504 && vma->prot == PTE_READ);
+		assert(vma_find(&space, 0x10 + 504)->start == 0x10 + 506);
+		assert(vma_find(&space, 0x10 + 2000) == NULL);
+
+		/* pages are populated on first touch, with the area's permissions */
+		assert(page_table_query(pt, 0x10 + 501) == NO_MAPPING);
+		ppn = page_table_query_or_fault(pt, 0x10 + 501, &space.handler);
+		assert(ppn != NO_MAPPING && page_table_query(pt, 0x10 + 501) == ppn);
+		assert((page_table_query_pte(pt, 0x10 + 501) & PTE_PROT) == PTE_READ);
+		assert(page_table_query_or_fault(pt, 0x10 + 501, &space.handler) == ppn);
+		assert(page_table_query_or_fault(pt, 0x11, &space.handler) == NO_MAPPING);
+
+		/* unmapping the middle of an area splits it */
+		vma_unmap(&space, 0x10 + 501, 1);
+		assert(space.count == 999);
+		assert(page_table_query(pt, 0x10 + 501) == NO_MAPPING);
+		vma = vma_find(&space, 0x10 + 500);
+		assert(vma->start == 0x10 + 499 && vma->end == 0x10 + 501);
+		vma = vma_find(&space, 0x10 + 501);
+		assert(vma->start == 0x10 + 502 && vma->end == 0x10 + 504 && vma->prot == PTE_READ);
+		assert(vma_get_unmapped_area(&space, 1) == 0x11);
+
+		page_table_query_or_fault(pt, 0x10 + 1998, &space.handler);
+		vma_space_destroy(&space);
+		assert(space.count == 0 && vma_get_unmapped_area(&space, 1ULL << 44) == 0x10);
+		page_table_destroy(pt);
+		assert(frames_in_use() == before);
+	}
+	printf("vma_Test: PASSED\n");
+
+	// numa_replication_Test
+	{
+		static struct numa_pt npt;
+		struct numa_test_thread threads[2];
+		uint64_t before = frames_in_use();
+
+		/* without replication the second node walks the home node's tables */
+		numa_pt_init(&npt, 2, 0);
+		numa_pt_update(&npt, 0, 0x42, 0x1042);
+		assert(numa_pt_query(&npt, 1, 0x42) == 0x1042);
+		assert(numa_pt_query(&npt, 0, 0x42) == 0x1042);
+		assert(npt.replicas[1].pt == 0);
+		assert(npt.replicas[1].remote_refs == 5 && npt.replicas[1].local_refs == 0);
+		assert(npt.replicas[0].local_refs == 5 && npt.replicas[0].remote_refs == 0);
+		numa_pt_destroy(&npt);
+
+		/* with it, the second node's first touch copies the home replica */
+		numa_pt_init(&npt, 2, 1);
+		for (uint64_t vpn = 0; vpn < 100; vpn++)
+			numa_pt_update(&npt, 0, vpn << 9, vpn + 0x2000);
+		assert(npt.replicas[1].pt == 0);
+		assert(numa_pt_query(&npt, 1, 99 << 9) == 99 + 0x2000);
+		assert(npt.replicas[1].pt != 0 && npt.replicas[1].pt != npt.replicas[0].pt);
+		assert(npt.replicas[1].remote_refs == 0 && npt.replicas[1].local_refs == 5);
+
+		/* updates reach the other replica through the log, even a full log behind */
+		numa_pt_update(&npt, 1, 5 << 9, NO_MAPPING);
+		assert(numa_pt_query(&npt, 0, 5 << 9) == NO_MAPPING);
+		for (uint64_t i = 0; i < 3 * NUMA_LOG_SIZE; i++)
+			numa_pt_update(&npt, 0, 0x7000 + i % 700, i);
+		assert(npt.replicas[1].applied + NUMA_LOG_SIZE >= npt.log_tail);
+		assert(numa_pt_query(&npt, 1, 0x7000 + (3 * NUMA_LOG_SIZE - 1) % 700) == 3 * NUMA_LOG_SIZE - 1);
+		assert(numa_pt_query(&npt, 1, 5 << 9) == NO_MAPPING);
+		assert(npt.replicas[1].applied == npt.log_tail);
+
+		/* both nodes updating and querying at once */
+		for (unsigned int i = 0; i < 2; i++) {
+			threads[i] = (struct numa_test_thread){ .npt = &npt, .node = i };
+			assert(pthread_create(&threads[i].thread, NULL, numa_test_run, &threads[i]) == 0);
+		}
+		for (unsigned int i = 0; i < 2; i++) {
+			void *failed;
+
+			pthread_join(threads[i].thread, &failed);
+			assert(failed == NULL);
+		}
+		for (uint64_t i = 0; i < 3000; i += 37) {
+			assert(numa_pt_query(&npt, 0, 0x200000 + i) == 0x200000 + i + 7);
+			assert(numa_pt_query(&npt, 1, 0x100000 + i) == 0x100000 + i + 7);
+		}
+		assert(npt.replicas[0].remote_refs == 0 && npt.replicas[1].remote_refs == 0);
+
+		numa_pt_destroy(&npt);
+		assert(frames_in_use() == before);
+	}
+	printf("numa_replication_Test: PASSED\n");
+
+	// accounting_Test
+	{
+		struct counting_handler handler = { { counting_fault, 0 }, 0, NO_MAPPING };
+		struct pt_limits limits = { 0, 0 };
+		struct pt_mapping maps[64];
+		struct pt_usage usage;
+		uint64_t before = frames_in_use();
+
+		/* data frames are made up, so every frame taken is a table */
+		pt = alloc_page_frame();
+		page_table_update(pt, 0x1, 0x2);
+		assert(page_table_usage(pt, &usage) == -1);
+		page_table_account(pt, NULL);
+		assert(page_table_usage(pt, &usage) == 0);
+		assert(usage.pages == 1 && usage.tables == 4 && usage.leaf_tables == 1);
+
+		for (uint64_t i = 0; i < 1000; i++)
+			page_table_update(pt, (i * 0x123457) & 0xffffffff, i);
+		page_table_update(pt, 0x1, 0x3);
+		assert(usage_matches(pt, before));
+		for (uint64_t i = 0; i < 1000; i += 3)
+			page_table_update(pt, (i * 0x123457) & 0xffffffff, NO_MAPPING);
+		assert(usage_matches(pt, before));
+
+		/* the bulk operations keep it up to date too */
+		page_table_unmap_range(pt, 0x1000000, 0x40000000);
+		assert(usage_matches(pt, before));
+		for (int i = 0; i < 64; i++) {
+			maps[i].vpn = 0x200000000ULL + i * 0x301;
+			maps[i].ppn = i;
+		}
+		page_table_build(pt, maps, 64);
+		assert(usage_matches(pt, before));
+		page_table_move_range(pt, 0x200000000ULL, 0x300000000ULL, 0x40000);
+		assert(usage_matches(pt, before));
+		page_table_move_range(pt, 0x300000000ULL, 0x380000005ULL, 0x4000);
+		assert(usage_matches(pt, before));
+		page_table_update(pt, 0x200000010ULL, 0x10);
+		page_table_move_range(pt, 0x380000000ULL, 0x200000000ULL, 0x40000);
+		assert(usage_matches(pt, before));
+		assert(page_table_query_or_fault(pt, 0x777, &handler.handler) == 0x777 + 0x9000);
+		assert(usage_matches(pt, before));
+
+		/* a page limit refuses new pages but not remapping old ones */
+		page_table_usage(pt, &usage);
+		limits.max_pages = usage.pages + 1;
+		page_table_account(pt, &limits);
+		assert(page_table_update_checked(pt, 0x778, 0x10) == 0);
+		assert(page_table_update_checked(pt, 0x779, 0x10) == -1 && errno == EDQUOT);
+		assert(page_table_query(pt, 0x779) == NO_MAPPING);
+		assert(page_table_update_checked(pt, 0x778, 0x11) == 0);
+		handler.calls = 0;
+		assert(page_table_query_or_fault(pt, 0x779, &handler.handler) == NO_MAPPING);
+		assert(handler.calls == 0);
+
+		/* a table limit refuses mappings that need a new table */
+		page_table_usage(pt, &usage);
+		limits.max_pages = 0;
+		limits.max_tables = usage.tables + usage.leaf_tables;
+		page_table_account(pt, &limits);
+		assert(page_table_update_checked(pt, 0x779, 0x12) == 0);
+		assert(page_table_update_checked(pt, 0x100000000000ULL, 0x12) == -1 && errno == EDQUOT);
+		assert(usage_matches(pt, before));
+
+		/* internal mappers report the refusal instead of carrying on */
+		{
+			static struct nested_mmu mmu;
+			struct vma_space space;
+			struct pt_limits one_page = { 1, 0 };
+			uint64_t in_use = frames_in_use(), hpt;
+
+			vma_space_init(&space, pt, 0x100000000000ULL, 0x100000001000ULL);
+			assert(vma_map(&space, 0x100000000000ULL, 1, PTE_READ) == 0x100000000000ULL);
+			assert(space.handler.fault(&space.handler, pt, 0x100000000000ULL) == NO_MAPPING);
+			assert(errno == EDQUOT && frames_in_use() == in_use);
+			vma_space_destroy(&space);
+
+			/* a host with room for the guest root and nothing more */
+			hpt = alloc_page_frame();
+			page_table_account(hpt, &one_page);
+			assert(nested_init(&mmu, hpt) == 0);
+			assert(nested_alloc_guest_frame(&mmu) == NO_MAPPING && errno == EDQUOT);
+			assert(nested_guest_update(&mmu, 0x123456789, 0x5) == -1);
+			assert(mmu.next_gppn == 1 && nested_query(&mmu, 0x123456789) == NO_MAPPING);
+			free_page_frame(page_table_query(hpt, 0));
+			page_table_destroy(hpt);
+			assert(frames_in_use() == in_use);
+		}
+
+		page_table_destroy(pt);
+		assert(frames_in_use() == before);
+	}
+	printf("accounting_Test: PASSED\n");
+
+	// update_reserved_Test
+	{
+		struct frame_reserve reserve = { 0 };
+		uint64_t before, ppn;
+
+		pt = alloc_page_frame();
+		page_table_update(pt, 0x1, 0x2);
+		assert(reserve_page_frames(&reserve, 4) == 0 && reserve.count == 4);
+
+		/* cap memory at what is allocated now */
+		before = frames_in_use();
+		set_page_frame_limit(before);
+		assert(reserve_page_frames(&reserve, 5) == -1);
+		assert(errno == ENOMEM && reserve.count == 4);
+
+		/* a shortage fails the update before anything changes */
+		assert(page_table_update_checked(pt, 0x1ULL << 36, 0x5) == -1);
+		assert(errno == ENOMEM);
+		assert(page_table_query(pt, 0x1ULL << 36) == NO_MAPPING);
+		assert(frames_in_use() == before);
+
+		/* what needs no new table still works, and unmapping never allocates */
+		assert(page_table_update_checked(pt, 0x3, 0x6) == 0);
+		assert(page_table_update_checked(pt, 0x1, NO_MAPPING) == 0);
+		assert(page_table_query(pt, 0x1) == NO_MAPPING);
+		assert(page_table_update_checked(pt, 0x1ULL << 36, NO_MAPPING) == -1);
+		assert(errno == EINVAL);
+
+		/* with tables set aside beforehand the update cannot run short */
+		reserve.count--;
+		assert(page_table_update_reserved(pt, 0x1ULL << 36, 0x5, &reserve) == -1);
+		assert(errno == ENOMEM && reserve.count == 3);
+		reserve.count++;
+		assert(page_table_update_reserved(pt, 0x1ULL << 36, 0x5, &reserve) == 0);
+		assert(reserve.count == 0 && frames_in_use() == before);
+		assert(page_table_query(pt, 0x1ULL << 36) == 0x5);
+		assert(page_table_query(pt, 0x3) == 0x6);
+
+		set_page_frame_limit(0);
+		ppn = alloc_page_frame();
+		assert(reserve_page_frames(&reserve, 2) == 0);
+		release_page_frames(&reserve);
+		assert(reserve.count == 0);
+		free_page_frame(ppn);
+		page_table_destroy(pt);
+	}
+	printf("update_reserved_Test: PASSED\n");
+
+	// frame_sharing_Test
+	{
+		uint64_t before = frames_in_use(), frame, pt_b, pages = 0, leaf_tables;
+		struct pt_usage usage;
+
+		/* a frame with two references survives the first free */
+		frame = alloc_page_frame();
+		assert(page_frame_refs(frame) == 1);
+		page_frame_get(frame);
+		assert(page_frame_refs(frame) == 2);
+		free_page_frame(frame);
+		assert(page_frame_refs(frame) == 1 && frames_in_use() == before + 1);
+		free_page_frame(frame);
+		assert(frames_in_use() == before);
+
+		/* one level 2 subtree and one leaf table linked into a second root */
+		pt = alloc_page_frame();
+		pt_b = alloc_page_frame();
+		for (uint64_t i = 0; i < 0x40200; i += 0x101)
+			page_table_update(pt, 0x40000 + i, i);
+		page_table_update(pt_b, 0x40000, 0x1234);
+		page_table_update(pt_b, 0x80400, 0x1234);
+		page_table_account(pt, NULL);
+		page_table_account(pt_b, NULL);
+		assert(page_table_share_range(pt_b, pt, 0x40000, 0x40200) == 0);
+		assert(page_table_share_range(pt_b, pt, 0x40001, 0x200) == -1 && errno == EINVAL);
+		for (uint64_t i = 0; i < 0x40200; i += 0x101)
+			assert(page_table_query(pt_b, 0x40000 + i) == i);
+		assert(page_table_query(pt_b, 0x80400) == 0x1234);
+
+		/* a link is charged to no one: pt_b pays for its own tables only */
+		page_table_usage(pt_b, &usage);
+		assert(usage.pages == 1 && usage.tables == 4 && usage.leaf_tables == 1);
+
+		/* changes through one root show in the other, and pt that built the tables pays */
+		page_table_update(pt, 0x40005, 0x55);
+		assert(page_table_query(pt_b, 0x40005) == 0x55);
+		page_table_update(pt_b, 0x801fe, NO_MAPPING);
+		assert(page_table_query(pt, 0x801fe) == NO_MAPPING);
+		page_table_update(pt_b, 0x80007, 0x77);
+		page_table_walk(pt, 0, 1ULL << 45, count_pte, &pages);
+		page_table_usage(pt, &usage);
+		assert(usage.pages == pages);
+		page_table_usage(pt_b, &usage);
+		assert(usage.pages == 1 && usage.tables == 4 && usage.leaf_tables == 1);
+
+		/* pt letting go of a leaf pt_b still links stops paying for it */
+		leaf_tables = usage_of(pt).leaf_tables;
+		page_table_unmap_range(pt, 0x80000, 0x200);
+		assert(page_table_query(pt_b, 0x80007) == 0x77);
+		pages = 0;
+		page_table_walk(pt, 0, 1ULL << 45, count_pte, &pages);
+		assert(usage_of(pt).pages == pages && usage_of(pt).leaf_tables == leaf_tables - 1);
+
+		/* the shared tables outlive the root they came from, charged to no one */
+		page_table_destroy(pt);
+		assert(page_table_query(pt_b, 0x40000 + 0x101 * 3) == 0x101 * 3);
+		assert(page_table_query(pt_b, 0x40000 + 0x101 * 1021) == 0x101 * 1021);
+		page_table_update(pt_b, 0x80008, 0x88);
+		page_table_update(pt_b, 0x40006, 0x66);
+		page_table_unmap_range(pt_b, 0x40000, 0x40000);
+		page_table_usage(pt_b, &usage);
+		assert(usage.pages == 1 && usage.tables == 4 && usage.leaf_tables == 1);
+		page_table_destroy(pt_b);
+		assert(frames_in_use() == before);
+	}
+	printf("frame_sharing_Test: PASSED\n");
+
+	// page_table_compact_Test
+	{
+		uint64_t before = frames_in_use(), in_use, pt_b, prev, seed = 1;
+		uint64_t vpns[200], shared;
+		struct pt_usage usage;
+
+		/* two roots growing in turn leave each one's tables interleaved */
+		pt = alloc_page_frame();
+		pt_b = alloc_page_frame();
+		for (int i = 0; i < 200; i++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			vpns[i] = (seed >> 19) & ((1ULL << 45) - 1);
+			page_table_update(pt, vpns[i], i);
+			page_table_update(pt_b, vpns[i] ^ 0x1000, i);
+		}
+		shared = (vpns[0] ^ 0x1000) & ~0x1ffULL;
+		page_table_share_range(pt, pt_b, shared, 0x200);
+		prev = 0;
+		assert(dfs_order_breaks(phys_to_virt(pt << 12), 0, &prev) > 100);
+
+		/* every table but the root moves, into one run; pt is not charged for the shared leaf */
+		page_table_account(pt, NULL);
+		page_table_usage(pt, &usage);
+		in_use = frames_in_use();
+		assert(page_table_compact(pt) == usage.tables + usage.leaf_tables - 1);
+		assert(frames_in_use() == in_use);
+		prev = 0;
+		assert(dfs_order_breaks(phys_to_virt(pt << 12), 0, &prev) <= 3);
+		assert(page_table_query(pt, vpns[0] ^ 0x1000) == 0);
+		for (int i = 0; i < 200; i++)
+			assert(page_table_query(pt, vpns[i]) == (uint64_t)i);
+
+		page_table_destroy(pt);
+		page_table_destroy(pt_b);
+		assert(frames_in_use() == before);
+	}
+	printf("page_table_compact_Test: PASSED\n");
+
+	// copy_on_write_Test
+	{
+		static struct vm_mmu mmu;
+		uint64_t before = frames_in_use(), child, frames[8], in_use;
+		unsigned char byte;
+
+		pt = alloc_page_frame();
+		for (int i = 0; i < 8; i++) {
+			frames[i] = alloc_page_frame();
+			page_table_update(pt, 0x10 + i, frames[i]);
+			byte = 0xc0 + i;
+			assert(vm_write(pt, (0x10 + i) << 12, &byte, 1) == 0);
+		}
+		page_table_protect_range(pt, 0x17, 1, PTE_READ | PTE_USER);
+
+		/* both roots map the same frames, writable ones copy-on-write */
+		child = page_table_fork(pt);
+		for (int i = 0; i < 8; i++) {
+			assert(page_table_query(child, 0x10 + i) == frames[i]);
+			assert(page_frame_refs(frames[i]) == 2);
+			assert(vm_read(child, (0x10 + i) << 12, &byte, 1) == 0 && byte == 0xc0 + i);
+		}
+		assert(page_table_query_pte(pt, 0x10) & PTE_COW);
+		assert(!(page_table_query_pte(pt, 0x10) & PTE_WRITE));
+		assert(page_table_query_pte(child, 0x10) == page_table_query_pte(pt, 0x10));
+		assert(!(page_table_query_pte(child, 0x17) & (PTE_COW | PTE_WRITE)));
+
+		/* a write gives the writer its own copy and leaves the other alone */
+		byte = 0x55;
+		assert(vm_write(child, 0x10 << 12, &byte, 1) == 0);
+		assert(page_table_query(child, 0x10) != frames[0]);
+		assert(page_frame_refs(frames[0]) == 1);
+		assert(vm_read(pt, 0x10 << 12, &byte, 1) == 0 && byte == 0xc0);
+		assert(page_table_query_pte(child, 0x10) & PTE_WRITE);
+
+		vm_mmu_init(&mmu, child);
+		vm_store8(&mmu, (0x11 << 12) + 1, 0x66);
+		assert(!mmu.fault && vm_load8(&mmu, 0x11 << 12) == 0xc1);
+		assert(vm_read(pt, (0x11 << 12) + 1, &byte, 1) == 0 && byte == 0);
+
+		/* the last sharer keeps the frame, and permissions still hold */
+		in_use = frames_in_use();
+		assert(page_table_write_fault(pt, 0x10) == 0);
+		assert(page_table_query(pt, 0x10) == frames[0] && frames_in_use() == in_use);
+		assert(page_table_write_fault(pt, 0x17) == -1 && errno == EACCES);
+		assert(page_table_write_fault(pt, 0x20) == -1 && errno == EFAULT);
+		page_table_protect_range(pt, 0x17, 1, PTE_PROT);
+		assert(page_table_query_pte(pt, 0x17) & PTE_COW);
+		assert(page_table_write_fault(pt, 0x17) == 0);
+		assert(page_table_query(pt, 0x17) != frames[7]);
+
+		page_table_release(child);
+
+		/* merging forked pages takes a reference per page, so writes still copy */
+		{
+			uint64_t children[2];
+			struct ksm *ksm = ksm_create();
+
+			for (uint64_t vpn = 0x30; vpn < 0x32; vpn++) {
+				page_table_update(pt, vpn, alloc_page_frame());
+				memset(phys_to_virt(page_table_query(pt, vpn) << 12), 7, 4096);
+			}
+			children[0] = page_table_fork(pt);
+			children[1] = page_table_fork(pt);
+			ksm_register(ksm, children[0], 0x30, 2);
+			ksm_scan(ksm, 2);
+			ksm_scan(ksm, 2);
+			assert(page_table_query(children[0], 0x31) == page_table_query(pt, 0x30));
+
+			byte = 99;
+			assert(vm_write(children[1], 0x30 << 12, &byte, 1) == 0);
+			assert(vm_write(pt, 0x30 << 12, &byte, 1) == 0);
+			assert(vm_write(children[0], 0x30 << 12, &byte, 1) == 0);
+			assert(vm_read(children[0], 0x31 << 12, &byte, 1) == 0 && byte == 7);
+			assert(vm_read(pt, 0x31 << 12, &byte, 1) == 0 && byte == 7);
+
+			ksm_destroy(ksm);
+			page_table_release(children[0]);
+			page_table_release(children[1]);
+		}
+
+		/* a root linking pt's leaf table leaves the frames mapped there to pt */
+		child = alloc_page_frame();
+		assert(page_table_share_range(child, pt, 0, 0x200) == 0);
+		page_table_release(child);
+		assert(page_frame_refs(frames[1]) == 1);
+		assert(vm_read(pt, 0x11 << 12, &byte, 1) == 0 && byte == 0xc1);
+
+		page_table_release(pt);
+		assert(frames_in_use() == before);
+	}
+	printf("copy_on_write_Test: PASSED\n");
+
 	printf("All tests passed successfully!\n");
 
 	return 0;
 }
+
+#endif /* OS_NO_SELFTEST */
@@ -1,12 +1,239 @@
+#ifndef OS_H
+#define OS_H
 
+
+#include <stddef.h>
 #include <stdint.h>
 
 #define NO_MAPPING	(~0ULL)
 
+/* Leaf entry bits below the frame number; new mappings get every permission */
+#define PTE_VALID	0x001ULL
+#define PTE_READ	0x002ULL
+#define PTE_WRITE	0x004ULL
+#define PTE_EXEC	0x008ULL
+#define PTE_USER	0x010ULL
+#define PTE_ACCESSED	0x020ULL	/* set by the vm.c MMU, cleared by wss.c */
+#define PTE_PROT	(PTE_READ | PTE_WRITE | PTE_EXEC | PTE_USER)
+
+/*
+ * A swapped-out page: PTE_VALID clear, the swap slot where the frame number
+ * would be, and the PTE_PROT bits the page had. See swap.h.
+ */
+#define PTE_SWAP	0x040ULL
+#define pte_is_swap(pte)	(((pte) & (PTE_VALID | PTE_SWAP)) == PTE_SWAP)
+
+/*
+ * Copy-on-write: a page that may be written but whose frame may be shared,
+ * so PTE_WRITE is clear until page_table_write_fault gives it a frame of
+ * its own. Set by page_table_fork and page_table_protect_range.
+ */
+#define PTE_COW		0x080ULL
+
+/*
+ * Every allocated frame starts with one reference; a block counts them at
+ * its head. Freeing drops a reference, and the memory goes back only with
+ * the last one, so a frame mapped from several roots can be freed by each.
+ */
 uint64_t alloc_page_frame(void);
+void free_page_frame(uint64_t ppn);
+void page_frame_get(uint64_t ppn);
+uint32_t page_frame_refs(uint64_t ppn);	/* 0 if not allocated */
+
+/*
+ * Drop a reference without freeing; returns 1 if it was the last, and the
+ * caller then still owns the frame until it calls free_page_frame.
+ */
+int page_frame_put_testzero(uint64_t ppn);
+
+/* 2^order physically contiguous frames, aligned to their size */
+#define FRAME_MAX_ORDER	10
+uint64_t alloc_page_frames(unsigned int order);
+void free_page_frames(uint64_t ppn, unsigned int order);
+
+/*
+ * Frames set aside up front, so that a caller can later take them without
+ * calling the allocator and without a way to fail. reserve_page_frames tops
+ * the reserve up to count frames, or returns -1 with errno ENOMEM and leaves
+ * it as it was when physical memory cannot grow any further.
+ */
+#define FRAME_RESERVE_MAX	8
+
+struct frame_reserve {
+	unsigned int count;
+	uint64_t ppns[FRAME_RESERVE_MAX];
+};
+
+int reserve_page_frames(struct frame_reserve *reserve, unsigned int count);
+uint64_t take_reserved_frame(struct frame_reserve *reserve);
+void release_page_frames(struct frame_reserve *reserve);
+
+/* Cap the frames allocated at any one time, 0 for no cap */
+void set_page_frame_limit(uint64_t frames);
+
+struct frame_stats {
+	uint64_t total;				/* frames taken from the host */
+	uint64_t free;
+	uint64_t free_blocks[FRAME_MAX_ORDER + 1];
+	/* share of free memory in blocks too small for an order-k allocation */
+	double unusable[FRAME_MAX_ORDER + 1];
+};
+
+void page_frame_stats(struct frame_stats *stats);
+
+/* Spinlock kept with each allocated frame, for locking a page table frame */
+void page_frame_lock(uint64_t ppn);
+void page_frame_unlock(uint64_t ppn);
+
+/* A pointer kept with an allocated frame for its owner, cleared on free */
+void page_frame_set_private(uint64_t ppn, void *private);
+void *page_frame_private(uint64_t ppn);
 void* phys_to_virt(uint64_t phys_addr);
 
+/*
+ * page_table_update exits on errors, including an update that would take an
+ * accounted root over its limits. Code that maps pages into a limited root
+ * uses page_table_update_checked and handles the refusal.
+ */
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
+/*
+ * Footprint of one root, kept up to date by the pt.c functions once
+ * page_table_account has been called on it. Swapped-out pages count as
+ * pages, and the root counts as a table. Tables linked from another root
+ * by page_table_share_range are not counted; see there.
+ */
+struct pt_usage {
+	uint64_t pages;
+	uint64_t tables;	/* tables above the leaf level */
+	uint64_t leaf_tables;
+};
+
+/* 0 means no limit */
+struct pt_limits {
+	uint64_t max_pages;
+	uint64_t max_tables;	/* leaf tables included */
+};
+
+/*
+ * Start accounting a root, counting what it already holds, or change its
+ * limits. An update that would exceed a limit leaves the mapping as it was:
+ * page_table_update_checked then returns -1 with errno set to EDQUOT,
+ * page_table_query_or_fault returns NO_MAPPING without calling the handler,
+ * and page_table_update exits.
+ * page_table_build and page_table_move_range are accounted, not limited.
+ * page_table_usage returns -1 for a root that is not accounted.
+ */
+void page_table_account(uint64_t pt, const struct pt_limits *limits);
+int page_table_usage(uint64_t pt, struct pt_usage *usage);
+int page_table_update_checked(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+/*
+ * page_table_update_checked never exits: it also returns -1 with errno
+ * ENOMEM when the tables for vpn cannot be allocated, and EINVAL when
+ * unmapping a vpn that has no tables. Either way nothing changes.
+ *
+ * page_table_update_reserved takes new tables only from reserve and never
+ * calls the allocator. Up to 4 tables per update may be needed; with too
+ * few in reserve it fails with ENOMEM, again without changing anything.
+ */
+int page_table_update_reserved(uint64_t pt, uint64_t vpn, uint64_t ppn, struct frame_reserve *reserve);
+
+/* The whole leaf entry for vpn, or 0 if nothing is mapped there */
+uint64_t page_table_query_pte(uint64_t pt, uint64_t vpn);
+
+/*
+ * Set the PTE_PROT bits of every mapped or swapped-out page in the range;
+ * returns pages changed. Write access to a page whose frame is shared becomes PTE_COW.
+ */
+uint64_t page_table_protect_range(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t prot);
+
+/*
+ * Move count mappings from old_vpn to new_vpn, replacing whatever was mapped
+ * there, like mremap. Aligned spans move whole tables by relinking them.
+ */
+void page_table_move_range(uint64_t pt, uint64_t old_vpn, uint64_t new_vpn, uint64_t count);
+
+/*
+ * Map [vpn, vpn + count) in pt through src_pt's own tables, taking a
+ * reference to each, so that later changes made through either root show
+ * in both. vpn and count must be multiples of 512, one leaf table; what pt
+ * mapped there before is replaced. A shared table is freed with the last
+ * root linking to it. Returns -1 with errno EINVAL for a bad range or root.
+ *
+ * Accounting charges a shared table only to the root that built it, and
+ * so are the changes made in it through any root, under that root's
+ * limits. Once that root lets go of it, no root is charged for it.
+ */
+int page_table_share_range(uint64_t pt, uint64_t src_pt, uint64_t vpn, uint64_t count);
+
+/* Unmap a range, freeing every table it empties; mapped frames are left alone */
+void page_table_unmap_range(uint64_t pt, uint64_t vpn, uint64_t count);
+
+/* Free the root and every table below it; mapped frames are left alone */
+void page_table_destroy(uint64_t pt);
+
+/*
+ * A new root mapping what pt maps, to the same frames, with tables of its
+ * own laid out like page_table_build does. Each mapped frame gains a
+ * reference, and writable pages become PTE_COW in both roots, so flush
+ * the parent's vm TLB. Every mapped frame must be an allocated one;
+ * swapped-out pages are not inherited.
+ */
+uint64_t page_table_fork(uint64_t pt);
+
+/*
+ * Make vpn writable after a write found PTE_WRITE clear. A PTE_COW page
+ * gets a private copy of its frame, dropping its reference to the shared
+ * one, unless it holds the last reference. Returns 0 if the write may go
+ * ahead, or -1 with errno EFAULT if nothing is mapped, EACCES if the page
+ * is not writable, or ENOMEM if the copy cannot be allocated.
+ */
+int page_table_write_fault(uint64_t pt, uint64_t vpn);
+
+/*
+ * page_table_destroy, also dropping the reference to every frame mapped
+ * in tables no other root links
+ */
+void page_table_release(uint64_t pt);
+
+/*
+ * Call fn on every valid leaf entry in [vpn, vpn + count), in vpn order.
+ * fn may rewrite the entry; a nonzero return stops the walk and is returned.
+ */
+typedef int (*pt_walk_fn)(uint64_t vpn, uint64_t *pte, void *arg);
+int page_table_walk(uint64_t pt, uint64_t vpn, uint64_t count, pt_walk_fn fn, void *arg);
+
+struct pt_fault_handler {
+	/* Return the frame to map at vpn, or NO_MAPPING to leave it unmapped */
+	uint64_t (*fault)(struct pt_fault_handler *handler, uint64_t pt, uint64_t vpn);
+	/* Also offer this many aligned neighbouring vpns in the same leaf, 0 for none */
+	unsigned int fault_around;
+};
+
+/*
+ * page_table_query, but an unmapped vpn is first handed to the fault handler.
+ * A swapped-out page gets its PTE_PROT bits back, others get all of them,
+ * unless the handler already mapped the page itself.
+ */
+uint64_t page_table_query_or_fault(uint64_t pt, uint64_t vpn, struct pt_fault_handler *handler);
+
+struct pt_mapping {
+	uint64_t vpn;
+	uint64_t ppn;
+};
+
+/* Map count mappings, sorted by strictly increasing vpn, in one pass */
+void page_table_build(uint64_t pt, const struct pt_mapping *mappings, size_t count);
+
+/*
+ * Move every table below the root into fresh contiguous runs of frames, in
+ * depth-first order like page_table_build lays them out, so that a walk or
+ * a scan of neighbouring vpns touches neighbouring frames. Mappings do not
+ * change; tables shared with other roots stay put. Returns tables moved.
+ * Nothing else may use the root meanwhile.
+ */
+uint64_t page_table_compact(uint64_t pt);
 
+#endif
@@ -1,75 +1,254 @@
 #include "os.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
-void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn){
-    const uint64_t VALID_BIT = 1;
-    uint64_t vpn_indices[5];
-    uint64_t* page_table_pointers[5];
-    pt = pt << 12; // now pt holds the page table's address.
+// Below this many subtrees a teardown is not worth starting threads for.
+#define DESTROY_PARALLEL_MIN 16
+#define DESTROY_MAX_THREADS 8
 
-    for (int i = 0; i < 5; i++) {
-        vpn_indices[i] = (vpn >> (36 - (9 * i))) & 0x1FF;
+struct pt_account {
+    struct pt_usage usage;
+    struct pt_limits limits;
+    int gone; // its root is being destroyed, so nothing is counted anymore
+};
+
+// The account a table is charged to, or NULL if no root is charged for it. Every table keeps
+// it with its frame: a root its own, a new table the one of the table it is linked from. So a
+// table linked into another root stays charged to the root that built it, and so do the
+// changes made in it through any root.
+static struct pt_account* account_of(uint64_t table_ppn){
+    return page_frame_private(table_ppn);
+}
+
+static int entry_in_use(uint64_t entry){
+    return entry != 0 && entry != NO_MAPPING;
+}
+
+// Charges one table frame at the given level, or uncharges it if delta is -1.
+static void account_table(struct pt_account* account, int level, int64_t delta){
+    if (account == NULL || account->gone) {
+        return;
+    }
+    if (level == 4) {
+        account->usage.leaf_tables += delta;
+    } else {
+        account->usage.tables += delta;
     }
+}
 
-    page_table_pointers[0]  = (uint64_t*)(phys_to_virt(pt));
-    if (page_table_pointers[0] == NULL) {
-        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
-        exit(EXIT_FAILURE); // Exit on failure
+static void account_pages(struct pt_account* account, int64_t delta){
+    if (account != NULL && !account->gone) {
+        account->usage.pages += delta;
     }
+}
 
-    if (ppn == NO_MAPPING) {
-        for (int i = 0; i < 4; i++) {
-            uint64_t current_entry = page_table_pointers[i][vpn_indices[i]];
-            uint64_t physical_address = current_entry & ~1;
-            void* virtual_address = phys_to_virt(physical_address);
-            page_table_pointers[i + 1] = (uint64_t*)virtual_address;
+// Charges a new table at the given level, and what it will hold, to account.
+static void charge_table(uint64_t table_ppn, int level, struct pt_account* account){
+    if (account != NULL) {
+        page_frame_set_private(table_ppn, account);
+    }
+    account_table(account, level, 1);
+}
+
+// Counts the tables below this one, for sizing the runs a fork takes its tables from.
+static void count_usage(uint64_t* table, int level, struct pt_usage* usage){
+    for (int i = 0; i < 512; i++) {
+        uint64_t current_entry = table[i];
 
-            if (page_table_pointers[i + 1] == NULL || (current_entry & VALID_BIT) == 0) {
-                fprintf(stderr, "Error! Invalid or NULL page table entry at level %d.\n", i);
-                exit(EXIT_FAILURE); // Exit on failure
+        if (level == 4) {
+            usage->pages += entry_in_use(current_entry);
+        } else if ((current_entry & 1) != 0 && current_entry != NO_MAPPING) {
+            if (level + 1 == 4) {
+                usage->leaf_tables++;
+            } else {
+                usage->tables++;
             }
+            count_usage((uint64_t*)(phys_to_virt(current_entry & ~1)), level + 1, usage);
+        }
+    }
+}
+
+// Charges the table at the given level to account with everything below it, as far as no
+// root is charged for it yet and no other root links it.
+static void claim_subtree(uint64_t table_ppn, int level, struct pt_account* account){
+    uint64_t* table;
+
+    if (account == NULL || account_of(table_ppn) != NULL || page_frame_refs(table_ppn) > 1) {
+        return;
+    }
+    table = table_at(table_ppn);
+    charge_table(table_ppn, level, account);
+    for (int i = 0; i < 512; i++) {
+        if (level == 4) {
+            account_pages(account, entry_in_use(table[i]));
+        } else if (entry_present(table[i])) {
+            claim_subtree(table[i] >> 12, level + 1, account);
         }
+    }
+}
 
-        page_table_pointers[4][vpn_indices[4]] = NO_MAPPING;
-    } else {
-        for (int i = 0; i < 4; i++) {
-            if (!page_table_pointers[i]) {
-                fprintf(stderr, "Error! NULL pointer encountered at level %d.\n", i);
-                exit(EXIT_FAILURE); // Exit on failure
-            }
+// Undoes claim_subtree: account stops being charged for the table and for whatever below it
+// is charged there, for when its root lets go of a table that other roots still link.
+static void disown_subtree(uint64_t table_ppn, int level, struct pt_account* account){
+    uint64_t* table;
+
+    if (account == NULL || account_of(table_ppn) != account) {
+        return;
+    }
+    table = table_at(table_ppn);
+    page_frame_set_private(table_ppn, NULL);
+    account_table(account, level, -1);
+    for (int i = 0; i < 512; i++) {
+        if (level == 4) {
+            account_pages(account, -entry_in_use(table[i]));
+        } else if (entry_present(table[i])) {
+            disown_subtree(table[i] >> 12, level + 1, account);
+        }
+    }
+}
 
-            uint64_t current_entry = page_table_pointers[i][vpn_indices[i]];
+// What mapping vpn would add to the footprint: the missing tables and maybe a page. They
+// would be charged to the account of the last table on the way, stored in account.
+static struct pt_usage mapping_cost(uint64_t pt, uint64_t vpn, struct pt_account** account){
+    struct pt_usage cost = {0, 0, 0};
+    uint64_t table_ppn = pt;
+    uint64_t* table = (uint64_t*)(phys_to_virt(pt << 12));
 
-            if (current_entry == NO_MAPPING || (current_entry & VALID_BIT) == 0) {
-                uint64_t new_frame = alloc_page_frame();
+    for (int i = 0; i < 4; i++) {
+        uint64_t current_entry = table[(vpn >> (36 - (9 * i))) & 0x1FF];
 
-                if (new_frame == 0) {
-                    fprintf(stderr, "Error! Failed to allocate new page frame at level %d.\n", i);
-                    exit(EXIT_FAILURE); // Exit on failure
-                }
+        if (current_entry == NO_MAPPING || (current_entry & 1) == 0) {
+            cost.tables = 3 - i;
+            cost.leaf_tables = 1;
+            cost.pages = 1;
+            *account = account_of(table_ppn);
+            return cost;
+        }
+        table_ppn = current_entry >> 12;
+        table = (uint64_t*)(phys_to_virt(current_entry & ~1));
+    }
 
-                uint64_t aligned_frame = new_frame << 12;
-                uint64_t entry_with_valid_bit = aligned_frame | 1;
-                page_table_pointers[i][vpn_indices[i]] = entry_with_valid_bit;
-                current_entry = entry_with_valid_bit; // Update current_entry for next iteration
-            }
+    cost.pages = !entry_in_use(table[vpn & 0x1FF]);
+    *account = account_of(table_ppn);
+    return cost;
+}
 
-            uint64_t physical_address = current_entry & ~1;
-            void* virtual_address = phys_to_virt(physical_address);
+static int over_limit(const struct pt_account* account, const struct pt_usage* cost){
+    const struct pt_usage* usage = &account->usage;
 
-            if (virtual_address == NULL) {
-                fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", i);
-                exit(EXIT_FAILURE); // Exit on failure
-            }
+    if (account->limits.max_pages != 0 && usage->pages + cost->pages > account->limits.max_pages) {
+        return 1;
+    }
+    return account->limits.max_tables != 0
+        && usage->tables + usage->leaf_tables + cost->tables + cost->leaf_tables > account->limits.max_tables;
+}
 
-            page_table_pointers[i + 1] = (uint64_t*)virtual_address;
+// The one walk behind every update. Missing tables come from reserve, or straight from the
+// allocator if reserve is NULL; either way a shortage is found before anything changes.
+static int update_entry(uint64_t pt, uint64_t vpn, uint64_t ppn, struct frame_reserve* reserve){
+    const uint64_t VALID_BIT = 1;
+    struct pt_account* account;
+    struct frame_reserve own = {0};
+    uint64_t table_ppn = pt;
+    uint64_t* table = (uint64_t*)(phys_to_virt(pt << 12));
+    uint64_t* pte;
+    int level = 0;
+    int missing;
+
+    if (table == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Walk down as far as tables exist; level is where the first one is missing.
+    for (; level < 4; level++) {
+        uint64_t current_entry = table[(vpn >> (36 - (9 * level))) & 0x1FF];
+
+        if (current_entry == NO_MAPPING || (current_entry & VALID_BIT) == 0) {
+            break;
+        }
+        table_ppn = current_entry >> 12;
+        table = (uint64_t*)(phys_to_virt(current_entry & ~1));
+    }
+    missing = 4 - level;
+    account = account_of(table_ppn);
+
+    if (ppn == NO_MAPPING) {
+        if (missing != 0) {
+            errno = EINVAL; // nothing was ever mapped here
+            return -1;
+        }
+        pte = &table[vpn & 0x1FF];
+        account_pages(account, -entry_in_use(*pte));
+        *pte = NO_MAPPING;
+        return 0;
+    }
+
+    if (account != NULL) {
+        struct pt_usage cost = {
+            .pages = missing != 0 || !entry_in_use(table[vpn & 0x1FF]),
+            .tables = missing > 1 ? missing - 1 : 0,
+            .leaf_tables = missing != 0,
+        };
+        if (over_limit(account, &cost)) {
+            errno = EDQUOT;
+            return -1;
         }
+    }
+
+    if (missing != 0) {
+        if (reserve == NULL) {
+            if (reserve_page_frames(&own, missing) != 0) {
+                return -1;
+            }
+            reserve = &own;
+        } else if (reserve->count < (unsigned int)missing) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // From here on nothing can fail.
+    for (; level < 4; level++) {
+        uint64_t new_frame = take_reserved_frame(reserve);
 
-        page_table_pointers[4][vpn_indices[4]] = (ppn << 12) | 1;
+        table[(vpn >> (36 - (9 * level))) & 0x1FF] = (new_frame << 12) | 1;
+        charge_table(new_frame, level + 1, account);
+        table = table_at(new_frame);
+    }
+
+    pte = &table[vpn & 0x1FF];
+    account_pages(account, !entry_in_use(*pte));
+    *pte = mapped_entry(ppn);
+    return 0;
+}
+
+void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn){
+    if (update_entry(pt, vpn, ppn, NULL) != 0) {
+        if (errno == ENOMEM) {
+            fprintf(stderr, "Error! Failed to allocate new page frame.\n");
+        } else if (errno == EDQUOT) {
+            fprintf(stderr, "Error! Page table limit exceeded.\n");
+        } else {
+            fprintf(stderr, "Error! Invalid or NULL page table entry.\n");
+        }
+        exit(EXIT_FAILURE); // Exit on failure
     }
 }
 
+int page_table_update_checked(uint64_t pt, uint64_t vpn, uint64_t ppn){
+    return update_entry(pt, vpn, ppn, NULL);
+}
+
+int page_table_update_reserved(uint64_t pt, uint64_t vpn, uint64_t ppn, struct frame_reserve* reserve){
+    return update_entry(pt, vpn, ppn, reserve);
+}
+
 uint64_t page_table_query(uint64_t pt, uint64_t vpn){
     const uint64_t VALID_BIT = 1;
     uint64_t* page_table_pointers[5];
@@ -97,3 +276,895 @@ uint64_t page_table_query(uint64_t pt, uint64_t vpn){
 
     return valid_bit >> 12;
 }
+
+// First level whose table differs between two vpns, 5 if they share the leaf table.
+static int first_new_level(uint64_t vpn, uint64_t prev){
+    int level = 1;
+
+    while (level < 5 && (vpn >> (9 * (5 - level))) == (prev >> (9 * (5 - level)))) {
+        level++;
+    }
+    return level;
+}
+
+// Frames for tables, taken from contiguous runs as big as the tables still to place need.
+struct table_run {
+    uint64_t next;
+    uint64_t end;
+    uint64_t tables_left;
+};
+
+static uint64_t take_run_frame(struct table_run* run){
+    if (run->next == run->end) {
+        unsigned int order = 0;
+        while (order < FRAME_MAX_ORDER && (1ULL << order) < run->tables_left) {
+            order++;
+        }
+        run->next = alloc_page_frames(order);
+        run->end = run->next + (1ULL << order);
+    }
+    run->tables_left--;
+    return run->next++;
+}
+
+static void release_run(struct table_run* run){
+    while (run->next < run->end) {
+        free_page_frame(run->next++);
+    }
+}
+
+void page_table_build(uint64_t pt, const struct pt_mapping *mappings, size_t count){
+    const uint64_t VALID_BIT = 1;
+    uint64_t* page_table_pointers[5];
+    struct table_run run = {0, 0, 0};
+    struct pt_account* accounts[5]; // what the tables on the current path are charged to
+    accounts[0] = account_of(pt);
+    pt = pt << 12;
+
+    page_table_pointers[0] = (uint64_t*)(phys_to_virt(pt));
+    if (page_table_pointers[0] == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check the input and count the tables the build may need, so they can be taken
+    // from the allocator as contiguous runs.
+    for (size_t n = 0; n < count; n++) {
+        if (mappings[n].ppn == NO_MAPPING) {
+            fprintf(stderr, "Error! Cannot build a NO_MAPPING entry.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0 && mappings[n].vpn <= mappings[n - 1].vpn) {
+            fprintf(stderr, "Error! Mappings are not sorted by vpn.\n");
+            exit(EXIT_FAILURE);
+        }
+        run.tables_left += 5 - (n > 0 ? first_new_level(mappings[n].vpn, mappings[n - 1].vpn) : 1);
+    }
+
+    for (size_t n = 0; n < count; n++) {
+        uint64_t vpn = mappings[n].vpn;
+
+        // Tables covering the previous vpn's prefix are still the right ones, keep them.
+        int level = n > 0 ? first_new_level(vpn, mappings[n - 1].vpn) : 1;
+
+        // Only descend into tables we have not visited yet. Tables are allocated in
+        // depth-first order from contiguous runs, so the frames of one subtree end up
+        // next to each other.
+        for (; level < 5; level++) {
+            uint64_t index = (vpn >> (36 - (9 * (level - 1)))) & 0x1FF;
+            uint64_t current_entry = page_table_pointers[level - 1][index];
+
+            if (current_entry == NO_MAPPING || (current_entry & VALID_BIT) == 0) {
+                current_entry = (take_run_frame(&run) << 12) | 1;
+                page_table_pointers[level - 1][index] = current_entry;
+                charge_table(current_entry >> 12, level, accounts[level - 1]);
+                accounts[level] = accounts[level - 1];
+            } else {
+                run.tables_left--; // counted, but already there
+                accounts[level] = account_of(current_entry >> 12);
+            }
+
+            page_table_pointers[level] = (uint64_t*)(phys_to_virt(current_entry & ~1));
+            if (page_table_pointers[level] == NULL) {
+                fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", level - 1);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        account_pages(accounts[4], !entry_in_use(page_table_pointers[4][vpn & 0x1FF]));
+        page_table_pointers[4][vpn & 0x1FF] = mapped_entry(mappings[n].ppn);
+    }
+
+    // Tables that already existed leave the end of the last run unused.
+    release_run(&run);
+}
+
+// Tables compaction may move below the one at the given level. A table shared with another
+// root stays where it is, and so does everything below it.
+static uint64_t count_movable(uint64_t* table, int level){
+    uint64_t count = 0;
+
+    for (int i = 0; level < 4 && i < 512; i++) {
+        uint64_t current_entry = table[i];
+
+        if ((current_entry & 1) == 0 || current_entry == NO_MAPPING
+            || page_frame_refs(current_entry >> 12) > 1) {
+            continue;
+        }
+        count += 1 + count_movable((uint64_t*)(phys_to_virt(current_entry & ~0xFFFULL)), level + 1);
+    }
+    return count;
+}
+
+// Copies every movable table below this one into the run, in depth-first order.
+static uint64_t compact_table(uint64_t* table, int level, struct table_run* run){
+    uint64_t moved = 0;
+
+    for (int i = 0; level < 4 && i < 512; i++) {
+        uint64_t current_entry = table[i];
+
+        if ((current_entry & 1) == 0 || current_entry == NO_MAPPING
+            || page_frame_refs(current_entry >> 12) > 1) {
+            continue;
+        }
+
+        uint64_t new_frame = take_run_frame(run);
+        uint64_t* new_table = (uint64_t*)(phys_to_virt(new_frame << 12));
+
+        memcpy(new_table, phys_to_virt(current_entry & ~0xFFFULL), 4096);
+        page_frame_set_private(new_frame, account_of(current_entry >> 12));
+        table[i] = (new_frame << 12) | (current_entry & 0xFFF);
+        free_page_frame(current_entry >> 12);
+        moved += 1 + compact_table(new_table, level + 1, run);
+    }
+    return moved;
+}
+
+uint64_t page_table_compact(uint64_t pt){
+    uint64_t* root = (uint64_t*)(phys_to_virt(pt << 12));
+    struct table_run run = {0, 0, 0};
+    uint64_t moved;
+
+    if (root == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Count first so the runs are as few and as big as the allocator allows.
+    run.tables_left = count_movable(root, 0);
+    moved = compact_table(root, 0, &run);
+    release_run(&run);
+    return moved;
+}
+
+// Drops a link to the table at the given level from a table charged to owner. The last link
+// frees the table and every table below it, stopping at tables still shared with other roots,
+// and uncharges each from its account. Only valid entries are followed, and leaf tables are
+// freed without being read since their entries point to data, unless the pages in them have
+// to be uncharged.
+static void destroy_subtree(uint64_t table_ppn, int level, struct pt_account* owner){
+    struct pt_account* account = account_of(table_ppn);
+
+    // A table other roots still link is charged to owner no longer. This has to happen
+    // before the link goes, since after that another root may free the table.
+    if (account != NULL && account == owner && page_frame_refs(table_ppn) > 1) {
+        disown_subtree(table_ppn, level, account);
+        account = NULL;
+    }
+    if (!page_frame_put_testzero(table_ppn)) {
+        return;
+    }
+
+    if (level == 4 && account != NULL && !account->gone) {
+        uint64_t* table = (uint64_t*)(phys_to_virt(table_ppn << 12));
+        int64_t pages = 0;
+
+        for (int i = 0; i < 512; i++) {
+            pages += entry_in_use(table[i]);
+        }
+        account_pages(account, -pages);
+    }
+
+    if (level < 4) {
+        uint64_t* table = (uint64_t*)(phys_to_virt(table_ppn << 12));
+        if (table == NULL) {
+            fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", level);
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < 512; i++) {
+            uint64_t current_entry = table[i];
+            if ((current_entry & 1) != 0 && current_entry != NO_MAPPING) {
+                destroy_subtree(current_entry >> 12, level + 1, account);
+            }
+        }
+    }
+
+    account_table(account, level, -1);
+    free_page_frame(table_ppn);
+}
+
+struct destroy_work {
+    struct pt_account* account; // of the root being destroyed
+    uint64_t* ppns;
+    int* levels;
+    size_t count;
+    size_t next;
+};
+
+static void* destroy_worker(void* arg){
+    struct destroy_work* work = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+        destroy_subtree(work->ppns[i], work->levels[i], work->account);
+    }
+
+    return NULL;
+}
+
+void page_table_destroy(uint64_t pt){
+    struct destroy_work work = {0};
+    size_t capacity = 512;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[DESTROY_MAX_THREADS];
+    int started = 0;
+
+    if (nthreads > DESTROY_MAX_THREADS) {
+        nthreads = DESTROY_MAX_THREADS;
+    }
+    // Tables that outlive the root must not point at its account, but nothing else
+    // needs counting on the way out.
+    work.account = account_of(pt);
+    if (work.account != NULL) {
+        work.account->gone = 1;
+    }
+
+    work.ppns = malloc(capacity * sizeof(*work.ppns));
+    work.levels = malloc(capacity * sizeof(*work.levels));
+    if (work.ppns == NULL || work.levels == NULL) {
+        fprintf(stderr, "Error! Failed to allocate teardown work list.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Collect the subtrees below the root, splitting the upper levels until there is
+    // enough independent work for every thread. Split tables are freed right away.
+    work.ppns[0] = pt;
+    work.levels[0] = 0;
+    work.count = 1;
+    while (work.count > 0 && work.count < (size_t)nthreads * 4) {
+        size_t count = work.count;
+        size_t kept = 0;
+        int split = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (work.levels[i] >= 3) {
+                continue;
+            }
+
+            if (page_frame_refs(work.ppns[i]) > 1) {
+                disown_subtree(work.ppns[i], work.levels[i], work.account);
+            }
+            if (!page_frame_put_testzero(work.ppns[i])) {
+                work.ppns[i] = NO_MAPPING; // still shared, nothing below it is ours to free
+                split = 1;
+                continue;
+            }
+
+            uint64_t* table = (uint64_t*)(phys_to_virt(work.ppns[i] << 12));
+            if (table == NULL) {
+                fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", work.levels[i]);
+                exit(EXIT_FAILURE);
+            }
+
+            for (int j = 0; j < 512; j++) {
+                uint64_t current_entry = table[j];
+                if ((current_entry & 1) == 0 || current_entry == NO_MAPPING) {
+                    continue;
+                }
+
+                if (work.count == capacity) {
+                    capacity *= 2;
+                    work.ppns = realloc(work.ppns, capacity * sizeof(*work.ppns));
+                    work.levels = realloc(work.levels, capacity * sizeof(*work.levels));
+                    if (work.ppns == NULL || work.levels == NULL) {
+                        fprintf(stderr, "Error! Failed to allocate teardown work list.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+
+                work.ppns[work.count] = current_entry >> 12;
+                work.levels[work.count] = work.levels[i] + 1;
+                work.count++;
+            }
+
+            free_page_frame(work.ppns[i]);
+            work.ppns[i] = NO_MAPPING;
+            split = 1;
+        }
+
+        if (!split) {
+            break;
+        }
+
+        // Drop the tables that were just split.
+        for (size_t i = 0; i < work.count; i++) {
+            if (work.ppns[i] != NO_MAPPING) {
+                work.ppns[kept] = work.ppns[i];
+                work.levels[kept] = work.levels[i];
+                kept++;
+            }
+        }
+        work.count = kept;
+    }
+
+    if (work.count >= DESTROY_PARALLEL_MIN && nthreads > 1) {
+        for (long t = 0; t < nthreads; t++) {
+            if (pthread_create(&threads[started], NULL, destroy_worker, &work) == 0) {
+                started++;
+            }
+        }
+    }
+
+    // The calling thread always helps, and finishes everything if no thread started.
+    destroy_worker(&work);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(work.ppns);
+    free(work.levels);
+    free(work.account);
+}
+
+// With swapped set, swapped-out leaf entries are visited as well.
+static int walk_table(uint64_t* table, int level, uint64_t base, uint64_t start, uint64_t end,
+                      int swapped, pt_walk_fn fn, void* arg){
+    uint64_t span = 1ULL << (9 * (4 - level)); // vpns covered by one entry
+    int first = start > base ? (int)((start - base) / span) : 0;
+
+    for (int i = first; i < 512; i++) {
+        uint64_t entry_vpn = base + i * span;
+        uint64_t current_entry = table[i];
+        int ret;
+
+        if (entry_vpn >= end) {
+            break;
+        }
+        if (level == 4 && swapped && pte_is_swap(current_entry)) {
+            ret = fn(entry_vpn, &table[i], arg);
+            if (ret != 0) {
+                return ret;
+            }
+            continue;
+        }
+        if ((current_entry & 1) == 0 || current_entry == NO_MAPPING) {
+            continue;
+        }
+
+        if (level == 4) {
+            ret = fn(entry_vpn, &table[i], arg);
+        } else {
+            uint64_t* next_table = (uint64_t*)(phys_to_virt(current_entry & ~1));
+            if (next_table == NULL) {
+                fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", level);
+                exit(EXIT_FAILURE);
+            }
+            ret = walk_table(next_table, level + 1, entry_vpn, start, end, swapped, fn, arg);
+        }
+
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int walk_range(uint64_t pt, uint64_t vpn, uint64_t count, int swapped, pt_walk_fn fn, void* arg){
+    const uint64_t VPN_LIMIT = 1ULL << 45;
+    uint64_t* root = (uint64_t*)(phys_to_virt(pt << 12));
+    uint64_t end = count > VPN_LIMIT - vpn ? VPN_LIMIT : vpn + count;
+
+    if (root == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (vpn >= VPN_LIMIT) {
+        return 0;
+    }
+
+    return walk_table(root, 0, 0, vpn, end, swapped, fn, arg);
+}
+
+int page_table_walk(uint64_t pt, uint64_t vpn, uint64_t count, pt_walk_fn fn, void* arg){
+    return walk_range(pt, vpn, count, 0, fn, arg);
+}
+
+// Returns the table at the given level on the path to vpn, or NULL if some table on the
+// way is missing and allocate is 0. With allocate set, missing tables are created like
+// page_table_update does. If account is not NULL, it gets what the table is charged to.
+static uint64_t* walk_to_table(uint64_t pt, uint64_t vpn, int level, int allocate,
+                               struct pt_account** account){
+    uint64_t table_ppn = pt;
+    uint64_t* table = (uint64_t*)(phys_to_virt(pt << 12));
+
+    if (table == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < level; i++) {
+        uint64_t index = (vpn >> (36 - (9 * i))) & 0x1FF;
+        uint64_t current_entry = table[index];
+
+        if (current_entry == NO_MAPPING || (current_entry & 1) == 0) {
+            if (!allocate) {
+                return NULL;
+            }
+
+            current_entry = (alloc_page_frame() << 12) | 1;
+            table[index] = current_entry;
+            charge_table(current_entry >> 12, i + 1, account_of(table_ppn));
+        }
+
+        table_ppn = current_entry >> 12;
+        table = (uint64_t*)(phys_to_virt(current_entry & ~1));
+        if (table == NULL) {
+            fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (account != NULL) {
+        *account = account_of(table_ppn);
+    }
+    return table;
+}
+
+static uint64_t* walk_to_leaf(uint64_t pt, uint64_t vpn, int allocate, struct pt_account** account){
+    return walk_to_table(pt, vpn, 4, allocate, account);
+}
+
+// Permissions for a page faulted in over the given non-present entry.
+static uint64_t fault_prot(uint64_t old_entry){
+    return pte_is_swap(old_entry) ? old_entry & PTE_PROT : PTE_PROT;
+}
+
+uint64_t page_table_query_or_fault(uint64_t pt, uint64_t vpn, struct pt_fault_handler* handler){
+    uint64_t ppn = page_table_query(pt, vpn);
+    struct pt_account* account;
+    struct pt_usage cost;
+    uint64_t* leaf;
+    uint64_t start, end;
+
+    if (ppn != NO_MAPPING) {
+        return ppn;
+    }
+
+    // Refuse before the handler hands out a frame that could not be mapped.
+    cost = mapping_cost(pt, vpn, &account);
+    if (account != NULL && over_limit(account, &cost)) {
+        errno = EDQUOT;
+        return NO_MAPPING;
+    }
+
+    ppn = handler->fault(handler, pt, vpn);
+    if (ppn == NO_MAPPING) {
+        return NO_MAPPING;
+    }
+
+    leaf = walk_to_leaf(pt, vpn, 1, &account);
+    if (!entry_present(leaf[vpn & 0x1FF])) {
+        account_pages(account, !entry_in_use(leaf[vpn & 0x1FF]));
+        leaf[vpn & 0x1FF] = (ppn << 12) | PTE_VALID | fault_prot(leaf[vpn & 0x1FF]);
+    }
+
+    if (handler->fault_around <= 1) {
+        return ppn;
+    }
+
+    // Fault-around: offer the still unmapped neighbours in the same aligned window to the
+    // handler now, while the leaf table is at hand, instead of one fault and walk each.
+    start = vpn - (vpn % handler->fault_around);
+    end = start + handler->fault_around;
+    if (start < (vpn & ~0x1FFULL)) {
+        start = vpn & ~0x1FFULL;
+    }
+    if (end > (vpn | 0x1FF) + 1) {
+        end = (vpn | 0x1FF) + 1;
+    }
+
+    for (uint64_t around = start; around < end; around++) {
+        uint64_t current_entry = leaf[around & 0x1FF];
+        uint64_t around_ppn;
+
+        if (around == vpn || ((current_entry & 1) != 0 && current_entry != NO_MAPPING)) {
+            continue;
+        }
+        if (account != NULL) {
+            cost = (struct pt_usage){!entry_in_use(current_entry), 0, 0};
+            if (over_limit(account, &cost)) {
+                break;
+            }
+        }
+
+        around_ppn = handler->fault(handler, pt, around);
+        if (around_ppn != NO_MAPPING && !entry_present(leaf[around & 0x1FF])) {
+            account_pages(account, !entry_in_use(leaf[around & 0x1FF]));
+            leaf[around & 0x1FF] = (around_ppn << 12) | PTE_VALID | fault_prot(current_entry);
+        }
+    }
+
+    return ppn;
+}
+
+uint64_t page_table_query_pte(uint64_t pt, uint64_t vpn){
+    uint64_t* leaf = walk_to_leaf(pt, vpn, 0, NULL);
+
+    if (leaf == NULL || leaf[vpn & 0x1FF] == NO_MAPPING) {
+        return 0;
+    }
+    return leaf[vpn & 0x1FF];
+}
+
+struct protect_range {
+    uint64_t prot;
+    uint64_t changed;
+};
+
+static int protect_pte(uint64_t vpn, uint64_t* pte, void* arg){
+    struct protect_range* protect = arg;
+    uint64_t new_pte = (*pte & ~(PTE_PROT | PTE_COW)) | protect->prot;
+
+    (void)vpn;
+    // Writes to a frame another mapping shares must copy it first. A swapped-out page
+    // holds a slot, not a frame, and comes back in a frame of its own.
+    if (!pte_is_swap(*pte) && (new_pte & PTE_WRITE) != 0 && !(*pte & PTE_WRITE)
+        && ((*pte & PTE_COW) != 0 || page_frame_refs(*pte >> 12) > 1)) {
+        new_pte = (new_pte & ~PTE_WRITE) | PTE_COW;
+    }
+    if (new_pte != *pte) {
+        *pte = new_pte;
+        protect->changed++;
+    }
+    return 0;
+}
+
+uint64_t page_table_protect_range(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t prot){
+    struct protect_range protect = {prot & PTE_PROT, 0};
+
+    // The walk rewrites each leaf table in one pass and skips subtrees with nothing mapped.
+    // Swapped-out pages keep their PTE_PROT bits until the fault, so they are rewritten too.
+    walk_range(pt, vpn, count, 1, protect_pte, &protect);
+    return protect.changed;
+}
+
+void page_table_move_range(uint64_t pt, uint64_t old_vpn, uint64_t new_vpn, uint64_t count){
+    if (old_vpn == new_vpn || count == 0) {
+        return;
+    }
+    if (old_vpn < new_vpn + count && new_vpn < old_vpn + count) {
+        fprintf(stderr, "Error! Cannot move a range onto itself.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (count > 0) {
+        int level = 1;
+        uint64_t span;
+
+        // Move the biggest subtree both positions are aligned to: one entry swap moves a
+        // whole table. Level 0 entries are never moved, that would need the root itself.
+        while (level < 4) {
+            span = 1ULL << (9 * (4 - level));
+            if (old_vpn % span == 0 && new_vpn % span == 0 && count >= span) {
+                break;
+            }
+            level++;
+        }
+
+        if (level < 4) {
+            struct pt_account *old_account = NULL, *new_account = NULL;
+            uint64_t* old_table = walk_to_table(pt, old_vpn, level, 0, &old_account);
+            uint64_t* old_slot = old_table ? &old_table[(old_vpn >> (36 - (9 * level))) & 0x1FF] : NULL;
+            int present = old_slot != NULL && (*old_slot & 1) != 0 && *old_slot != NO_MAPPING;
+            uint64_t* new_table = walk_to_table(pt, new_vpn, level, present, &new_account);
+
+            if (new_table != NULL) {
+                uint64_t* new_slot = &new_table[(new_vpn >> (36 - (9 * level))) & 0x1FF];
+
+                // Whatever was mapped at the destination is replaced, like mremap does.
+                if ((*new_slot & 1) != 0 && *new_slot != NO_MAPPING) {
+                    destroy_subtree(*new_slot >> 12, level + 1, new_account);
+                }
+                *new_slot = present ? *old_slot : 0;
+                // Moved under a table charged elsewhere, as a path through a linked table
+                // can be, the subtree is charged there too.
+                if (present && old_account != new_account) {
+                    disown_subtree(*old_slot >> 12, level + 1, old_account);
+                    claim_subtree(*old_slot >> 12, level + 1, new_account);
+                }
+            }
+            if (present) {
+                *old_slot = 0;
+            }
+        } else {
+            // Unaligned: copy entries, but only walk once per pair of leaf tables.
+            span = 512 - (old_vpn & 0x1FF);
+            if (512 - (new_vpn & 0x1FF) < span) {
+                span = 512 - (new_vpn & 0x1FF);
+            }
+            if (count < span) {
+                span = count;
+            }
+
+            struct pt_account *old_account = NULL, *new_account = NULL;
+            uint64_t* old_leaf = walk_to_leaf(pt, old_vpn, 0, &old_account);
+            uint64_t* new_leaf = walk_to_leaf(pt, new_vpn, old_leaf != NULL, &new_account);
+
+            for (uint64_t i = 0; new_leaf != NULL && i < span; i++) {
+                uint64_t* old_pte = old_leaf ? &old_leaf[(old_vpn + i) & 0x1FF] : NULL;
+                uint64_t* new_pte = &new_leaf[(new_vpn + i) & 0x1FF];
+                // Swapped-out entries move too, or their page and slot would be lost.
+                int in_use = old_pte != NULL && entry_in_use(*old_pte);
+
+                account_pages(new_account, in_use - entry_in_use(*new_pte));
+                account_pages(old_account, -in_use);
+                *new_pte = in_use ? *old_pte : 0;
+                if (old_pte != NULL) {
+                    *old_pte = 0;
+                }
+            }
+        }
+
+        old_vpn += span;
+        new_vpn += span;
+        count -= span;
+    }
+}
+
+int page_table_share_range(uint64_t pt, uint64_t src_pt, uint64_t vpn, uint64_t count){
+    const uint64_t VPN_LIMIT = 1ULL << 45;
+
+    if (pt == src_pt || vpn % 512 != 0 || count % 512 != 0 || vpn > VPN_LIMIT
+        || count > VPN_LIMIT - vpn || phys_to_virt(pt << 12) == NULL
+        || phys_to_virt(src_pt << 12) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (count > 0) {
+        int level = 1;
+        uint64_t span;
+
+        // Link the biggest aligned subtree, as page_table_move_range does.
+        while (level < 3) {
+            span = 1ULL << (9 * (4 - level));
+            if (vpn % span == 0 && count >= span) {
+                break;
+            }
+            level++;
+        }
+        span = 1ULL << (9 * (4 - level));
+
+        struct pt_account* account = NULL;
+        uint64_t* src_table = walk_to_table(src_pt, vpn, level, 0, NULL);
+        uint64_t index = (vpn >> (36 - (9 * level))) & 0x1FF;
+        uint64_t src_entry = src_table != NULL ? src_table[index] : 0;
+        int present = entry_present(src_entry);
+        uint64_t* table = walk_to_table(pt, vpn, level, present, &account);
+
+        if (table != NULL) {
+            // Whatever pt had there is replaced, as a new mapping would be.
+            if (entry_present(table[index])) {
+                destroy_subtree(table[index] >> 12, level + 1, account);
+            }
+            // The link itself is charged to no one: the tables stay with src_pt.
+            table[index] = present ? src_entry : 0;
+            if (present) {
+                page_frame_get(src_entry >> 12);
+            }
+        }
+
+        vpn += span;
+        count -= span;
+    }
+
+    return 0;
+}
+
+// Clears [start, end) in the table at the given level, which covers the vpns from base and
+// is charged to account. Fully covered entries drop their whole subtree; returns 1 if the
+// table is left empty.
+static int unmap_table(uint64_t* table, int level, uint64_t base, uint64_t start, uint64_t end,
+                       struct pt_account* account){
+    uint64_t span = 1ULL << (9 * (4 - level));
+    int first = start > base ? (int)((start - base) / span) : 0;
+
+    for (int i = first; i < 512; i++) {
+        uint64_t entry_vpn = base + i * span;
+        uint64_t current_entry = table[i];
+
+        if (entry_vpn >= end) {
+            break;
+        }
+
+        if (level == 4 || (current_entry & 1) == 0 || current_entry == NO_MAPPING) {
+            if (level == 4) {
+                account_pages(account, -entry_in_use(current_entry));
+            }
+            table[i] = 0;
+        } else if (entry_vpn >= start && end - entry_vpn >= span) {
+            destroy_subtree(current_entry >> 12, level + 1, account);
+            table[i] = 0;
+        } else {
+            uint64_t* next_table = (uint64_t*)(phys_to_virt(current_entry & ~1));
+            if (next_table == NULL) {
+                fprintf(stderr, "Error! Failed to convert physical address to virtual address at level %d.\n", level);
+                exit(EXIT_FAILURE);
+            }
+
+            if (unmap_table(next_table, level + 1, entry_vpn, start, end, account_of(current_entry >> 12))) {
+                destroy_subtree(current_entry >> 12, level + 1, account);
+                table[i] = 0;
+            }
+        }
+    }
+
+    // Only the partially covered tables at the two ends of the range get here with
+    // entries left, so the scan costs at most two tables per level.
+    for (int i = 0; i < 512; i++) {
+        if (table[i] != 0 && table[i] != NO_MAPPING) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void page_table_unmap_range(uint64_t pt, uint64_t vpn, uint64_t count){
+    const uint64_t VPN_LIMIT = 1ULL << 45;
+    uint64_t* root = (uint64_t*)(phys_to_virt(pt << 12));
+    uint64_t end = count > VPN_LIMIT - vpn ? VPN_LIMIT : vpn + count;
+
+    if (root == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (vpn >= VPN_LIMIT || count == 0) {
+        return;
+    }
+
+    unmap_table(root, 0, 0, vpn, end, account_of(pt));
+}
+
+void page_table_account(uint64_t pt, const struct pt_limits* limits){
+    struct pt_account* account = account_of(pt);
+
+    if (account == NULL) {
+        account = calloc(1, sizeof(*account));
+        if (account == NULL) {
+            fprintf(stderr, "Error! Failed to allocate page table accounting.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // The one walk accounting ever needs; from here on every change is counted as made.
+        // Tables other roots link, or already charged elsewhere, are left out.
+        claim_subtree(pt, 0, account);
+    }
+
+    account->limits = limits != NULL ? *limits : (struct pt_limits){0, 0};
+}
+
+int page_table_usage(uint64_t pt, struct pt_usage* usage){
+    struct pt_account* account = account_of(pt);
+
+    if (account == NULL) {
+        return -1;
+    }
+    *usage = account->usage;
+    return 0;
+}
+
+// Copies the tables below src into dst, sharing the frames the leaf entries map.
+static void fork_table(uint64_t* src, uint64_t* dst, int level, struct table_run* run){
+    for (int i = 0; i < 512; i++) {
+        uint64_t current_entry = src[i];
+
+        if (!entry_present(current_entry)) {
+            continue;
+        }
+
+        if (level == 4) {
+            // Neither side may write the shared frame until a write fault copies it.
+            if ((current_entry & PTE_WRITE) != 0) {
+                current_entry = (current_entry & ~PTE_WRITE) | PTE_COW;
+                src[i] = current_entry;
+            }
+            page_frame_get(current_entry >> 12);
+            dst[i] = current_entry;
+        } else {
+            uint64_t new_frame = take_run_frame(run);
+
+            dst[i] = (new_frame << 12) | 1;
+            fork_table((uint64_t*)(phys_to_virt(current_entry & ~0xFFFULL)),
+                       (uint64_t*)(phys_to_virt(new_frame << 12)), level + 1, run);
+        }
+    }
+}
+
+uint64_t page_table_fork(uint64_t pt){
+    uint64_t* root = (uint64_t*)(phys_to_virt(pt << 12));
+    struct pt_usage usage = {0};
+    struct table_run run = {0, 0, 0};
+    uint64_t child;
+
+    if (root == NULL) {
+        fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    count_usage(root, 0, &usage);
+    run.tables_left = usage.tables + usage.leaf_tables;
+    child = alloc_page_frame();
+    fork_table(root, (uint64_t*)(phys_to_virt(child << 12)), 0, &run);
+    release_run(&run);
+    return child;
+}
+
+int page_table_write_fault(uint64_t pt, uint64_t vpn){
+    uint64_t* leaf = walk_to_leaf(pt, vpn, 0, NULL);
+    uint64_t* pte = leaf != NULL ? &leaf[vpn & 0x1FF] : NULL;
+    uint64_t entry;
+
+    if (pte == NULL || !entry_present(*pte)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    entry = *pte;
+    if ((entry & PTE_WRITE) != 0) {
+        return 0;
+    }
+    if ((entry & PTE_COW) == 0) {
+        errno = EACCES;
+        return -1;
+    }
+
+    // Whoever holds the last reference keeps the frame as it is.
+    if (page_frame_refs(entry >> 12) > 1) {
+        struct frame_reserve reserve = {0};
+
+        if (reserve_page_frames(&reserve, 1) != 0) {
+            return -1;
+        }
+        uint64_t new_frame = take_reserved_frame(&reserve);
+        memcpy(phys_to_virt(new_frame << 12), phys_to_virt((entry >> 12) << 12), 4096);
+        free_page_frame(entry >> 12);
+        entry = (new_frame << 12) | (entry & 0xFFF);
+    }
+
+    *pte = (entry & ~PTE_COW) | PTE_WRITE;
+    return 0;
+}
+
+// Drops the references the leaf entries below this table hold, for the tables only this
+// root links; a table another root links too still maps its frames there.
+static void release_frames(uint64_t* table, int level){
+    for (int i = 0; i < 512; i++) {
+        uint64_t current_entry = table[i];
+
+        if (!entry_present(current_entry)) {
+            continue;
+        }
+        if (level == 4) {
+            free_page_frame(current_entry >> 12);
+        } else if (page_frame_refs(current_entry >> 12) == 1) {
+            release_frames(table_at(current_entry >> 12), level + 1);
+        }
+    }
+}
+
+void page_table_release(uint64_t pt){
+    release_frames(table_at(pt), 0);
+    page_table_destroy(pt);
+}
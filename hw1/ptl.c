@@ -0,0 +1,123 @@
+#include "os.h"
+#include "ptl.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t load_entry(uint64_t* slot){
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t new_table_entry(void){
+    return (alloc_page_frame() << 12) | 1;
+}
+
+// The entry an update leaves behind: the same as page_table_update writes for a mapping,
+// and unmapping a vpn that is not mapped leaves the entry alone.
+static uint64_t updated_entry(uint64_t old_entry, uint64_t ppn){
+    if (ppn == NO_MAPPING) {
+        return entry_present(old_entry) ? NO_MAPPING : old_entry;
+    }
+    return mapped_entry(ppn);
+}
+
+// Frame number of the table holding vpn's leaf entry, installing missing tables on the way
+// when allocate is set. Returns 0 if a table is missing and allocate is not set.
+static uint64_t leaf_table(enum ptl_mode mode, uint64_t pt, uint64_t vpn, int allocate){
+    uint64_t table_ppn = pt;
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t* slot = &table_at(table_ppn)[(vpn >> (36 - (9 * i))) & 0x1FF];
+        uint64_t current_entry = load_entry(slot);
+
+        if (!entry_present(current_entry)) {
+            if (!allocate) {
+                return 0;
+            }
+
+            if (mode == PTL_SPLIT) {
+                // Check and fill under the parent's lock: only one thread allocates.
+                page_frame_lock(table_ppn);
+                current_entry = *slot;
+                if (!entry_present(current_entry)) {
+                    current_entry = new_table_entry();
+                    __atomic_store_n(slot, current_entry, __ATOMIC_RELEASE);
+                }
+                page_frame_unlock(table_ppn);
+            } else if (mode == PTL_CAS) {
+                // Allocate up front, and give the frame back if another thread got there first.
+                uint64_t new_entry = new_table_entry();
+
+                if (__atomic_compare_exchange_n(slot, &current_entry, new_entry, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    current_entry = new_entry;
+                } else {
+                    free_page_frame(new_entry >> 12);
+                }
+            } else {
+                current_entry = new_table_entry();
+                *slot = current_entry;
+            }
+        }
+
+        table_ppn = current_entry >> 12;
+    }
+    return table_ppn;
+}
+
+void ptl_update(enum ptl_mode mode, uint64_t pt, uint64_t vpn, uint64_t ppn){
+    uint64_t leaf_ppn;
+    uint64_t* slot;
+
+    if (mode == PTL_GLOBAL) {
+        pthread_mutex_lock(&global_lock);
+    }
+
+    leaf_ppn = leaf_table(mode, pt, vpn, ppn != NO_MAPPING);
+    if (leaf_ppn != 0) {
+        slot = &table_at(leaf_ppn)[vpn & 0x1FF];
+
+        if (mode == PTL_SPLIT) {
+            page_frame_lock(leaf_ppn);
+            __atomic_store_n(slot, updated_entry(*slot, ppn), __ATOMIC_RELEASE);
+            page_frame_unlock(leaf_ppn);
+        } else if (mode == PTL_CAS) {
+            uint64_t old_entry = load_entry(slot);
+
+            while (!__atomic_compare_exchange_n(slot, &old_entry, updated_entry(old_entry, ppn), 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            }
+        } else {
+            __atomic_store_n(slot, updated_entry(*slot, ppn), __ATOMIC_RELEASE);
+        }
+    }
+
+    if (mode == PTL_GLOBAL) {
+        pthread_mutex_unlock(&global_lock);
+    }
+}
+
+uint64_t ptl_query(enum ptl_mode mode, uint64_t pt, uint64_t vpn){
+    uint64_t result = NO_MAPPING;
+    uint64_t leaf_ppn;
+
+    if (mode == PTL_GLOBAL) {
+        pthread_mutex_lock(&global_lock);
+    }
+
+    leaf_ppn = leaf_table(mode, pt, vpn, 0);
+    if (leaf_ppn != 0) {
+        uint64_t pte = load_entry(&table_at(leaf_ppn)[vpn & 0x1FF]);
+        if (entry_present(pte)) {
+            result = pte >> 12;
+        }
+    }
+
+    if (mode == PTL_GLOBAL) {
+        pthread_mutex_unlock(&global_lock);
+    }
+    return result;
+}
@@ -0,0 +1,34 @@
+#ifndef PTL_H
+#define PTL_H
+
+#include <stdint.h>
+
+/*
+ * Page table updates and queries that are safe to call from several threads
+ * on the same root. Three strategies, to be compared with bench.c:
+ *
+ *   PTL_GLOBAL  one mutex serializes every update and query.
+ *   PTL_CAS     lock-free: a missing table is installed with compare and
+ *               swap, and leaf entries are updated in a compare and swap
+ *               loop. A thread that loses the race for a table frees it.
+ *   PTL_SPLIT   like Linux split PTL: every table frame has its own spinlock.
+ *               Writers allocate and install a missing child under the
+ *               parent's lock, and read and rewrite the leaf entry under
+ *               the leaf table's lock.
+ *
+ * A mapping writes the same fresh entry as page_table_update. An update
+ * reads the old entry, so that unmapping a vpn that has no mapping does
+ * nothing. In the CAS and split modes queries take no lock. Tables are
+ * never freed while the root is shared, and a root must stick to one mode.
+ * ptl roots are not accounted: page_table_account does not see ptl_update.
+ */
+enum ptl_mode {
+	PTL_GLOBAL,
+	PTL_CAS,
+	PTL_SPLIT,
+};
+
+void ptl_update(enum ptl_mode mode, uint64_t pt, uint64_t vpn, uint64_t ppn);
+uint64_t ptl_query(enum ptl_mode mode, uint64_t pt, uint64_t vpn);
+
+#endif
@@ -0,0 +1,305 @@
+#include "os.h"
+#include "swap.h"
+#include "util.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define READAHEAD_QUEUE (2 * SWAP_MAX_READAHEAD)
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_SWAPPED, // only in the file
+    SLOT_READING, // queued for or being read by the worker
+    SLOT_CACHED,  // read ahead into cached[slot]
+};
+
+struct swap_device {
+    struct pt_fault_handler handler; // first, so the handler leads back to the device
+    struct pt_fault_handler* fallback;
+    int fd;
+    uint64_t nslots;
+    unsigned int readahead;
+    uint8_t* slots;
+    uint64_t* cached;
+    uint64_t next_slot;  // where the search for a free slot starts
+    uint64_t last_fault; // slot of the previous swap-in, to spot sequential faults
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // the worker has slots to read, or should stop
+    pthread_cond_t read;   // the worker finished a slot
+    uint64_t queue[READAHEAD_QUEUE];
+    unsigned int queue_head;
+    unsigned int queue_len;
+    int stopping;
+    pthread_t worker;
+
+    struct swap_stats stats;
+};
+
+// Reads a slot into a new frame. Called without the lock.
+static uint64_t read_slot(struct swap_device* swap, uint64_t slot, double* seconds){
+    uint64_t ppn = alloc_page_frame();
+    double start = now();
+
+    if (pread(swap->fd, frame_at(ppn), 4096, (off_t)(slot * 4096)) != 4096) {
+        fprintf(stderr, "Error! Failed to read swap slot %llu.\n", (unsigned long long)slot);
+        exit(EXIT_FAILURE);
+    }
+    *seconds = now() - start;
+    return ppn;
+}
+
+static void* readahead_worker(void* arg){
+    struct swap_device* swap = arg;
+
+    pthread_mutex_lock(&swap->lock);
+    for (;;) {
+        while (swap->queue_len == 0 && !swap->stopping) {
+            pthread_cond_wait(&swap->queued, &swap->lock);
+        }
+        if (swap->stopping) {
+            break;
+        }
+
+        uint64_t slot = swap->queue[swap->queue_head];
+        double seconds;
+        swap->queue_head = (swap->queue_head + 1) % READAHEAD_QUEUE;
+        swap->queue_len--;
+
+        pthread_mutex_unlock(&swap->lock);
+        uint64_t ppn = read_slot(swap, slot, &seconds);
+        pthread_mutex_lock(&swap->lock);
+
+        // A slot in SLOT_READING is only waited on, never freed, so it is still ours.
+        swap->cached[slot] = ppn;
+        swap->slots[slot] = SLOT_CACHED;
+        swap->stats.readahead_reads++;
+        swap->stats.bytes_read += 4096;
+        swap->stats.read_seconds += seconds;
+        pthread_cond_broadcast(&swap->read);
+    }
+    pthread_mutex_unlock(&swap->lock);
+    return NULL;
+}
+
+// Queues the slots after a sequential fault. Called with the lock held.
+static void queue_readahead(struct swap_device* swap, uint64_t slot){
+    for (uint64_t next = slot + 1; next <= slot + swap->readahead && next < swap->nslots; next++) {
+        if (swap->slots[next] != SLOT_SWAPPED) {
+            continue;
+        }
+        if (swap->queue_len == READAHEAD_QUEUE) {
+            break;
+        }
+
+        swap->queue[(swap->queue_head + swap->queue_len) % READAHEAD_QUEUE] = next;
+        swap->queue_len++;
+        swap->slots[next] = SLOT_READING;
+    }
+    pthread_cond_signal(&swap->queued);
+}
+
+static uint64_t swap_fault(struct pt_fault_handler* handler, uint64_t pt, uint64_t vpn){
+    struct swap_device* swap = (struct swap_device*)handler;
+    uint64_t pte, slot;
+    uint64_t ppn = 0;
+    double seconds = 0;
+    int hit = 0;
+
+    // The PTE is only rewritten under the lock, so a fault that waited sees it resolved.
+    pthread_mutex_lock(&swap->lock);
+    pte = page_table_query_pte(pt, vpn);
+    if (!pte_is_swap(pte)) {
+        pthread_mutex_unlock(&swap->lock);
+        if (entry_present(pte)) {
+            return pte >> 12;
+        }
+        if (swap->fallback == NULL) {
+            return NO_MAPPING;
+        }
+        return swap->fallback->fault(swap->fallback, pt, vpn);
+    }
+
+    slot = pte >> 12;
+    if (swap->readahead != 0 && slot == swap->last_fault + 1) {
+        queue_readahead(swap, slot);
+    }
+    swap->last_fault = slot;
+
+    while (swap->slots[slot] == SLOT_READING) {
+        pthread_cond_wait(&swap->read, &swap->lock);
+    }
+    // Another fault on the page swapped it in while we waited and freed the slot.
+    if (page_table_query_pte(pt, vpn) != pte) {
+        ppn = page_table_query(pt, vpn);
+        pthread_mutex_unlock(&swap->lock);
+        return ppn;
+    }
+    if (swap->slots[slot] == SLOT_CACHED) {
+        ppn = swap->cached[slot];
+        hit = 1;
+        swap->stats.readahead_hits++;
+    }
+    // Claim the slot so that readahead and other faults leave it alone.
+    swap->slots[slot] = SLOT_READING;
+    pthread_mutex_unlock(&swap->lock);
+
+    if (ppn == 0) {
+        ppn = read_slot(swap, slot, &seconds);
+    }
+
+    pthread_mutex_lock(&swap->lock);
+    if (!hit) {
+        swap->stats.bytes_read += 4096;
+        swap->stats.read_seconds += seconds;
+    }
+    // Map the page before waking the waiters, with the permissions it had. Refused over
+    // a limit, the frame stays read ahead for a later fault.
+    if (page_table_update_checked(pt, vpn, ppn) != 0) {
+        swap->cached[slot] = ppn;
+        swap->slots[slot] = SLOT_CACHED;
+        ppn = NO_MAPPING;
+    } else {
+        page_table_protect_range(pt, vpn, 1, pte & PTE_PROT);
+        swap->slots[slot] = SLOT_FREE;
+        swap->cached[slot] = 0;
+        swap->stats.slots_used--;
+        swap->stats.swap_ins++;
+    }
+    pthread_cond_broadcast(&swap->read);
+    pthread_mutex_unlock(&swap->lock);
+    return ppn;
+}
+
+struct swap_device* swap_open(const char* path, uint64_t nslots, unsigned int readahead,
+                              struct pt_fault_handler* fallback){
+    struct swap_device* swap = calloc(1, sizeof(*swap));
+
+    if (swap == NULL) {
+        fprintf(stderr, "Error! Failed to allocate swap device.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (readahead > SWAP_MAX_READAHEAD) {
+        readahead = SWAP_MAX_READAHEAD;
+    }
+
+    swap->handler.fault = swap_fault;
+    swap->handler.fault_around = 0;
+    swap->fallback = fallback;
+    swap->nslots = nslots;
+    swap->readahead = readahead;
+    swap->last_fault = NO_MAPPING - 1;
+    swap->slots = calloc(nslots, sizeof(*swap->slots));
+    swap->cached = calloc(nslots, sizeof(*swap->cached));
+    if (swap->slots == NULL || swap->cached == NULL) {
+        fprintf(stderr, "Error! Failed to allocate swap device.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    swap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (swap->fd < 0 || ftruncate(swap->fd, (off_t)(nslots * 4096)) != 0) {
+        fprintf(stderr, "Error! Failed to create swap file %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&swap->lock, NULL);
+    pthread_cond_init(&swap->queued, NULL);
+    pthread_cond_init(&swap->read, NULL);
+    if (pthread_create(&swap->worker, NULL, readahead_worker, swap) != 0) {
+        fprintf(stderr, "Error! Failed to start swap readahead thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    return swap;
+}
+
+void swap_close(struct swap_device* swap){
+    pthread_mutex_lock(&swap->lock);
+    swap->stopping = 1;
+    pthread_cond_signal(&swap->queued);
+    pthread_mutex_unlock(&swap->lock);
+    pthread_join(swap->worker, NULL);
+
+    // Frames read ahead but never faulted in.
+    for (uint64_t slot = 0; slot < swap->nslots; slot++) {
+        if (swap->slots[slot] == SLOT_CACHED) {
+            free_page_frame(swap->cached[slot]);
+        }
+    }
+
+    close(swap->fd);
+    pthread_cond_destroy(&swap->read);
+    pthread_cond_destroy(&swap->queued);
+    pthread_mutex_destroy(&swap->lock);
+    free(swap->cached);
+    free(swap->slots);
+    free(swap);
+}
+
+// Next-fit, so that pages swapped out one after another get consecutive slots.
+static uint64_t alloc_slot(struct swap_device* swap){
+    for (uint64_t i = 0; i < swap->nslots; i++) {
+        uint64_t slot = (swap->next_slot + i) % swap->nslots;
+
+        if (swap->slots[slot] == SLOT_FREE) {
+            swap->slots[slot] = SLOT_SWAPPED;
+            swap->next_slot = slot + 1;
+            return slot;
+        }
+    }
+    return NO_MAPPING;
+}
+
+static int set_swap_entry(uint64_t vpn, uint64_t* pte, void* arg){
+    (void)vpn;
+    *pte = *(uint64_t*)arg;
+    return 1;
+}
+
+int swap_out(struct swap_device* swap, uint64_t pt, uint64_t vpn){
+    uint64_t pte = page_table_query_pte(pt, vpn);
+    uint64_t slot;
+    double start;
+
+    if ((pte & PTE_VALID) == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&swap->lock);
+    slot = alloc_slot(swap);
+    pthread_mutex_unlock(&swap->lock);
+    if (slot == NO_MAPPING) {
+        return -1;
+    }
+
+    start = now();
+    if (pwrite(swap->fd, frame_at(pte >> 12), 4096, (off_t)(slot * 4096)) != 4096) {
+        fprintf(stderr, "Error! Failed to write swap slot %llu.\n", (unsigned long long)slot);
+        exit(EXIT_FAILURE);
+    }
+
+    // The page comes back in a frame of its own, so a copy-on-write page is plain writable.
+    uint64_t swap_entry = (slot << 12) | (pte & PTE_PROT) | (pte & PTE_COW ? PTE_WRITE : 0) | PTE_SWAP;
+    page_table_walk(pt, vpn, 1, set_swap_entry, &swap_entry);
+    free_page_frame(pte >> 12);
+
+    pthread_mutex_lock(&swap->lock);
+    swap->stats.slots_used++;
+    swap->stats.swap_outs++;
+    swap->stats.bytes_written += 4096;
+    swap->stats.write_seconds += now() - start;
+    pthread_mutex_unlock(&swap->lock);
+    return 0;
+}
+
+struct pt_fault_handler* swap_fault_handler(struct swap_device* swap){
+    return &swap->handler;
+}
+
+void swap_get_stats(struct swap_device* swap, struct swap_stats* stats){
+    pthread_mutex_lock(&swap->lock);
+    *stats = swap->stats;
+    pthread_mutex_unlock(&swap->lock);
+}
@@ -0,0 +1,53 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+
+/*
+ * Swap device backed by a local file, one 4 KiB slot per swapped-out page.
+ *
+ * swap_out writes a mapped page's frame to a free slot, frees the frame and
+ * leaves a PTE_SWAP entry in the page table. The page comes back when it is
+ * faulted in through page_table_query_or_fault with the device's handler.
+ * The handler reads the slot into a new frame, frees the slot and maps the
+ * page with the permissions it had. Concurrent faults on the page wait for
+ * the first one and return the frame it mapped.
+ *
+ * Slots are handed out in order, so pages swapped out together sit next to
+ * each other in the file. When a fault follows the previous fault's slot,
+ * the next readahead slots are read by a worker thread in the background. A
+ * later fault on one of them takes the frame that was already read.
+ *
+ * Faults on pages that are not swapped out go to the fallback handler, if
+ * there is one. Flush the vm TLB after swapping a page out. Unmapping a
+ * swapped-out page leaves its slot allocated until swap_close.
+ */
+#define SWAP_MAX_READAHEAD	32
+
+struct swap_device;
+struct pt_fault_handler;
+
+struct swap_stats {
+	uint64_t slots_used;
+	uint64_t swap_outs;
+	uint64_t swap_ins;
+	uint64_t readahead_reads;	/* slots read by the worker */
+	uint64_t readahead_hits;	/* swap-ins that found the frame already read */
+	uint64_t bytes_written;
+	uint64_t bytes_read;
+	double write_seconds;		/* time spent in pwrite and pread */
+	double read_seconds;
+};
+
+/* Create or truncate path to hold nslots pages */
+struct swap_device *swap_open(const char *path, uint64_t nslots, unsigned int readahead,
+			      struct pt_fault_handler *fallback);
+void swap_close(struct swap_device *swap);
+
+/* Returns 0, or -1 if vpn is not mapped or the device is full */
+int swap_out(struct swap_device *swap, uint64_t pt, uint64_t vpn);
+
+struct pt_fault_handler *swap_fault_handler(struct swap_device *swap);
+void swap_get_stats(struct swap_device *swap, struct swap_stats *stats);
+
+#endif
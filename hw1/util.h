@@ -0,0 +1,54 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "os.h"
+
+/*
+ * Small helpers shared by the page table modules. A table or data frame
+ * that phys_to_virt cannot translate is a bug, so these exit rather than
+ * return NULL.
+ */
+
+/* A table entry pointing somewhere: valid, and not the NO_MAPPING marker */
+static inline int entry_present(uint64_t entry)
+{
+	return (entry & PTE_VALID) != 0 && entry != NO_MAPPING;
+}
+
+/* The leaf entry every update path writes for a newly mapped frame */
+static inline uint64_t mapped_entry(uint64_t ppn)
+{
+	return (ppn << 12) | PTE_VALID | PTE_PROT;
+}
+
+static inline char *frame_at(uint64_t ppn)
+{
+	char *frame = phys_to_virt(ppn << 12);
+
+	if (frame == NULL) {
+		fprintf(stderr, "Error! Failed to convert physical address to virtual address.\n");
+		exit(EXIT_FAILURE);
+	}
+	return frame;
+}
+
+static inline uint64_t *table_at(uint64_t ppn)
+{
+	return (uint64_t *)frame_at(ppn);
+}
+
+/* Monotonic seconds, for timing */
+static inline double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#include "os.h"
+#include "vm.h"
+#include <string.h>
+
+struct vm_copy {
+    uint64_t pt;
+    uint64_t vaddr;
+    char* buf;
+    size_t left;
+    int write;
+    char* run_host; // pending memcpy over frames that are adjacent in host memory
+    char* run_buf;
+    size_t run_len;
+};
+
+static void flush_run(struct vm_copy* copy){
+    if (copy->run_len == 0) {
+        return;
+    }
+
+    if (copy->write) {
+        memcpy(copy->run_host, copy->run_buf, copy->run_len);
+    } else {
+        memcpy(copy->run_buf, copy->run_host, copy->run_len);
+    }
+    copy->run_len = 0;
+}
+
+// Called once per mapped page in vpn order; the walk only visits each leaf table once.
+static int copy_page(uint64_t vpn, uint64_t* pte, void* arg){
+    struct vm_copy* copy = arg;
+    uint64_t offset = copy->vaddr & 0xFFF;
+    size_t n = 4096 - offset;
+    char* host;
+
+    if (vpn != copy->vaddr >> 12) {
+        return 1; // hole before this page
+    }
+    if (copy->write && (*pte & PTE_COW) != 0) {
+        page_table_write_fault(copy->pt, vpn); // only rewrites this entry
+    }
+    if ((*pte & (copy->write ? PTE_WRITE : PTE_READ)) == 0) {
+        return 1;
+    }
+    *pte |= PTE_ACCESSED;
+
+    host = (char*)(phys_to_virt((*pte >> 12) << 12));
+    if (host == NULL) {
+        return 1;
+    }
+    host += offset;
+
+    if (n > copy->left) {
+        n = copy->left;
+    }
+
+    if (copy->run_len != 0 && copy->run_host + copy->run_len == host) {
+        copy->run_len += n;
+    } else {
+        flush_run(copy);
+        copy->run_host = host;
+        copy->run_buf = copy->buf;
+        copy->run_len = n;
+    }
+
+    copy->vaddr += n;
+    copy->buf += n;
+    copy->left -= n;
+    return copy->left == 0;
+}
+
+static size_t vm_copy(uint64_t pt, uint64_t vaddr, char* buf, size_t len, int write){
+    struct vm_copy copy = {pt, vaddr, buf, len, write, NULL, NULL, 0};
+    uint64_t pages;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    pages = ((vaddr + len - 1) >> 12) - (vaddr >> 12) + 1;
+    page_table_walk(pt, vaddr >> 12, pages, copy_page, &copy);
+    flush_run(&copy);
+    return copy.left;
+}
+
+size_t vm_read(uint64_t pt, uint64_t vaddr, void* buf, size_t len){
+    return vm_copy(pt, vaddr, buf, len, 0);
+}
+
+size_t vm_write(uint64_t pt, uint64_t vaddr, const void* buf, size_t len){
+    return vm_copy(pt, vaddr, (char*)buf, len, 1);
+}
+
+void vm_mmu_init(struct vm_mmu* mmu, uint64_t pt){
+    mmu->pt = pt;
+    mmu->fault = 0;
+    mmu->fault_vaddr = 0;
+    vm_tlb_flush(mmu);
+}
+
+void vm_tlb_flush(struct vm_mmu* mmu){
+    for (int i = 0; i < VM_TLB_ENTRIES; i++) {
+        mmu->tlb[i].addr_read = VM_TLB_INVALID;
+        mmu->tlb[i].addr_write = VM_TLB_INVALID;
+        mmu->tlb[i].addend = 0;
+    }
+}
+
+void vm_tlb_flush_page(struct vm_mmu* mmu, uint64_t vpn){
+    struct vm_tlb_entry* e = vm_tlb_lookup(mmu, vpn << 12);
+
+    if (e->addr_read == (vpn << 12) || e->addr_write == (vpn << 12)) {
+        e->addr_read = VM_TLB_INVALID;
+        e->addr_write = VM_TLB_INVALID;
+    }
+}
+
+// Looks up the single leaf entry of a fill, marking it accessed if the access is allowed.
+struct vm_fill {
+    uint64_t pte;
+    uint64_t needed; // PTE_READ or PTE_WRITE
+};
+
+static int fill_pte(uint64_t vpn, uint64_t* pte, void* arg){
+    struct vm_fill* fill = arg;
+
+    (void)vpn;
+    if ((*pte & fill->needed) != 0) {
+        *pte |= PTE_ACCESSED;
+    }
+    fill->pte = *pte;
+    return 1;
+}
+
+// Refills the TLB entry for vaddr's page from the page table; returns NULL on a fault.
+// Each tag is only set if the PTE grants that kind of access.
+static struct vm_tlb_entry* tlb_fill(struct vm_mmu* mmu, uint64_t vaddr, int write){
+    struct vm_tlb_entry* e = vm_tlb_lookup(mmu, vaddr);
+    uint64_t page = vaddr & VM_PAGE_MASK;
+    struct vm_fill fill = {0, write ? PTE_WRITE : PTE_READ};
+    uint64_t pte;
+    char* host = NULL;
+
+    if ((write ? e->addr_write : e->addr_read) == page) {
+        return e;
+    }
+
+    page_table_walk(mmu->pt, vaddr >> 12, 1, fill_pte, &fill);
+    pte = fill.pte;
+    if (write && (pte & PTE_VALID) != 0 && (pte & PTE_COW) != 0
+        && page_table_write_fault(mmu->pt, vaddr >> 12) == 0) {
+        page_table_walk(mmu->pt, vaddr >> 12, 1, fill_pte, &fill);
+        pte = fill.pte;
+    }
+    if ((pte & PTE_VALID) != 0 && (pte & (write ? PTE_WRITE : PTE_READ)) != 0) {
+        host = (char*)(phys_to_virt((pte >> 12) << 12));
+    }
+    if (host == NULL) {
+        mmu->fault = 1;
+        mmu->fault_vaddr = vaddr;
+        return NULL;
+    }
+
+    e->addr_read = (pte & PTE_READ) ? page : VM_TLB_INVALID;
+    e->addr_write = (pte & PTE_WRITE) ? page : VM_TLB_INVALID;
+    e->addend = (uintptr_t)host - page;
+    return e;
+}
+
+uint64_t vm_load_slow(struct vm_mmu* mmu, uint64_t vaddr, int size){
+    struct vm_tlb_entry* e;
+    uint64_t value = 0;
+
+    if ((vaddr & 0xFFF) + size > 4096) {
+        // Crosses into the next page: assemble the value a byte at a time.
+        for (int i = 0; i < size; i++) {
+            value |= (uint64_t)vm_load8(mmu, vaddr + i) << (8 * i);
+        }
+        return value;
+    }
+
+    e = tlb_fill(mmu, vaddr, 0);
+    if (e == NULL) {
+        return 0;
+    }
+    memcpy(&value, (void*)(uintptr_t)(vaddr + e->addend), size);
+    return value;
+}
+
+void vm_store_slow(struct vm_mmu* mmu, uint64_t vaddr, uint64_t value, int size){
+    struct vm_tlb_entry* e;
+
+    if ((vaddr & 0xFFF) + size > 4096) {
+        // Check both pages first so a faulting store does not land half way.
+        if (tlb_fill(mmu, vaddr, 1) == NULL || tlb_fill(mmu, vaddr + size - 1, 1) == NULL) {
+            return;
+        }
+        for (int i = 0; i < size; i++) {
+            vm_store8(mmu, vaddr + i, (uint8_t)(value >> (8 * i)));
+        }
+        return;
+    }
+
+    e = tlb_fill(mmu, vaddr, 1);
+    if (e == NULL) {
+        return;
+    }
+    memcpy((void*)(uintptr_t)(vaddr + e->addend), &value, size);
+}
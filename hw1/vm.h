@@ -0,0 +1,93 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Copy between a host buffer and the virtual address space of a page table,
+ * like copy_from_user/copy_to_user. Return the number of bytes that could
+ * not be copied because a page was not mapped or its PTE does not allow
+ * the access, 0 on success.
+ */
+size_t vm_read(uint64_t pt, uint64_t vaddr, void *buf, size_t len);
+size_t vm_write(uint64_t pt, uint64_t vaddr, const void *buf, size_t len);
+
+/*
+ * Software MMU for an interpreter: guest loads and stores go through a
+ * direct-mapped TLB in front of the page table. A hit is one compare and a
+ * host pointer add, inlined at the call site. Misses, unaligned accesses and
+ * accesses crossing a page go out of line and fall back to a page table walk,
+ * which sets PTE_ACCESSED. Guest memory is little-endian. An access to an
+ * unmapped page, or one the PTE does not allow, sets fault; loads return 0
+ * and stores are dropped. A store to a PTE_COW page, like vm_write, first
+ * takes page_table_write_fault; other MMUs on the root must then flush it.
+ *
+ * The TLB is not told about page table updates; flush it after unmapping or
+ * remapping a page.
+ */
+#define VM_TLB_BITS	8
+#define VM_TLB_ENTRIES	(1 << VM_TLB_BITS)
+#define VM_PAGE_MASK	(~0xfffULL)
+#define VM_TLB_INVALID	(~0ULL)
+
+struct vm_tlb_entry {
+	uint64_t addr_read;	/* page address for loads, or VM_TLB_INVALID */
+	uint64_t addr_write;	/* page address for stores, or VM_TLB_INVALID */
+	uintptr_t addend;	/* host address minus guest address */
+};
+
+struct vm_mmu {
+	uint64_t pt;
+	int fault;
+	uint64_t fault_vaddr;
+	struct vm_tlb_entry tlb[VM_TLB_ENTRIES];
+};
+
+void vm_mmu_init(struct vm_mmu *mmu, uint64_t pt);
+void vm_tlb_flush(struct vm_mmu *mmu);
+void vm_tlb_flush_page(struct vm_mmu *mmu, uint64_t vpn);
+
+uint64_t vm_load_slow(struct vm_mmu *mmu, uint64_t vaddr, int size);
+void vm_store_slow(struct vm_mmu *mmu, uint64_t vaddr, uint64_t value, int size);
+
+static inline struct vm_tlb_entry *vm_tlb_lookup(struct vm_mmu *mmu, uint64_t vaddr)
+{
+	return &mmu->tlb[(vaddr >> 12) & (VM_TLB_ENTRIES - 1)];
+}
+
+/* The size-1 bits in the compare send unaligned accesses to the slow path */
+#define VM_DEFINE_ACCESS(bits)							\
+static inline uint##bits##_t vm_load##bits(struct vm_mmu *mmu, uint64_t vaddr)	\
+{										\
+	struct vm_tlb_entry *e = vm_tlb_lookup(mmu, vaddr);			\
+	uint##bits##_t value;							\
+										\
+	if (e->addr_read == (vaddr & (VM_PAGE_MASK | (bits / 8 - 1)))) {	\
+		memcpy(&value, (void *)(uintptr_t)(vaddr + e->addend), bits / 8);	\
+		return value;							\
+	}									\
+	return vm_load_slow(mmu, vaddr, bits / 8);				\
+}										\
+										\
+static inline void vm_store##bits(struct vm_mmu *mmu, uint64_t vaddr,		\
+				  uint##bits##_t value)				\
+{										\
+	struct vm_tlb_entry *e = vm_tlb_lookup(mmu, vaddr);			\
+										\
+	if (e->addr_write == (vaddr & (VM_PAGE_MASK | (bits / 8 - 1)))) {	\
+		memcpy((void *)(uintptr_t)(vaddr + e->addend), &value, bits / 8);	\
+		return;								\
+	}									\
+	vm_store_slow(mmu, vaddr, value, bits / 8);				\
+}
+
+VM_DEFINE_ACCESS(8)
+VM_DEFINE_ACCESS(16)
+VM_DEFINE_ACCESS(32)
+VM_DEFINE_ACCESS(64)
+
+#undef VM_DEFINE_ACCESS
+
+#endif
@@ -0,0 +1,340 @@
+#include "os.h"
+#include "vma.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static int height_of(const struct vma* node){
+    return node != NULL ? node->height : 0;
+}
+
+static uint64_t max_gap_of(const struct vma* node){
+    return node != NULL ? node->max_gap : 0;
+}
+
+// Recomputes the annotations of a node from its children.
+static void update(struct vma* node){
+    int left = height_of(node->left);
+    int right = height_of(node->right);
+    uint64_t max_gap = node->gap;
+
+    node->height = (left > right ? left : right) + 1;
+    if (max_gap_of(node->left) > max_gap) {
+        max_gap = max_gap_of(node->left);
+    }
+    if (max_gap_of(node->right) > max_gap) {
+        max_gap = max_gap_of(node->right);
+    }
+    node->max_gap = max_gap;
+}
+
+static struct vma* rotate_right(struct vma* node){
+    struct vma* left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    update(node);
+    update(left);
+    return left;
+}
+
+static struct vma* rotate_left(struct vma* node){
+    struct vma* right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    update(node);
+    update(right);
+    return right;
+}
+
+static struct vma* rebalance(struct vma* node){
+    int balance;
+
+    update(node);
+    balance = height_of(node->left) - height_of(node->right);
+    if (balance > 1) {
+        if (height_of(node->left->left) < height_of(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (height_of(node->right->right) < height_of(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static struct vma* insert_node(struct vma* node, struct vma* vma){
+    if (node == NULL) {
+        return vma;
+    }
+    if (vma->start < node->start) {
+        node->left = insert_node(node->left, vma);
+    } else {
+        node->right = insert_node(node->right, vma);
+    }
+    return rebalance(node);
+}
+
+static struct vma* remove_min(struct vma* node, struct vma** min){
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = remove_min(node->left, min);
+    return rebalance(node);
+}
+
+static struct vma* remove_node(struct vma* node, const struct vma* vma){
+    if (node == vma) {
+        struct vma* successor;
+
+        if (node->right == NULL) {
+            return node->left;
+        }
+        node->right = remove_min(node->right, &successor);
+        successor->left = node->left;
+        successor->right = node->right;
+        return rebalance(successor);
+    }
+    if (vma->start < node->start) {
+        node->left = remove_node(node->left, vma);
+    } else {
+        node->right = remove_node(node->right, vma);
+    }
+    return rebalance(node);
+}
+
+// Sets the gap of vma and fixes the max_gap annotations on the path down to it.
+static void set_gap(struct vma* node, struct vma* vma, uint64_t gap){
+    if (node == vma) {
+        vma->gap = gap;
+    } else if (vma->start < node->start) {
+        set_gap(node->left, vma, gap);
+    } else {
+        set_gap(node->right, vma, gap);
+    }
+    update(node);
+}
+
+// The areas just before and just after vpn.
+static struct vma* prev_of(const struct vma_space* space, uint64_t vpn){
+    struct vma* prev = NULL;
+
+    for (struct vma* node = space->root; node != NULL;) {
+        if (node->start < vpn) {
+            prev = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return prev;
+}
+
+static struct vma* next_of(const struct vma_space* space, uint64_t vpn){
+    struct vma* next = NULL;
+
+    for (struct vma* node = space->root; node != NULL;) {
+        if (node->start > vpn) {
+            next = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return next;
+}
+
+static void link_vma(struct vma_space* space, struct vma* vma){
+    struct vma* prev = prev_of(space, vma->start);
+    struct vma* next = next_of(space, vma->start);
+
+    vma->left = NULL;
+    vma->right = NULL;
+    vma->gap = vma->start - (prev != NULL ? prev->end : space->low);
+    update(vma);
+    space->root = insert_node(space->root, vma);
+    if (next != NULL) {
+        set_gap(space->root, next, next->start - vma->end);
+    }
+    space->count++;
+}
+
+static void unlink_vma(struct vma_space* space, struct vma* vma){
+    struct vma* prev = prev_of(space, vma->start);
+    struct vma* next = next_of(space, vma->start);
+
+    space->root = remove_node(space->root, vma);
+    if (next != NULL) {
+        set_gap(space->root, next, next->start - (prev != NULL ? prev->end : space->low));
+    }
+    space->count--;
+}
+
+struct vma* vma_find(const struct vma_space* space, uint64_t vpn){
+    struct vma* found = NULL;
+
+    for (struct vma* node = space->root; node != NULL;) {
+        if (vpn < node->end) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+uint64_t vma_get_unmapped_area(const struct vma_space* space, uint64_t count){
+    struct vma* node = space->root;
+    struct vma* last = NULL;
+    uint64_t tail;
+
+    if (count == 0) {
+        return NO_MAPPING;
+    }
+
+    // Leftmost gap that fits: the max_gap annotations say which subtree holds one.
+    if (max_gap_of(node) >= count) {
+        for (;;) {
+            if (max_gap_of(node->left) >= count) {
+                node = node->left;
+            } else if (node->gap >= count) {
+                return node->start - node->gap;
+            } else {
+                node = node->right;
+            }
+        }
+    }
+
+    // Otherwise the space after the last area.
+    for (node = space->root; node != NULL; node = node->right) {
+        last = node;
+    }
+    tail = last != NULL ? last->end : space->low;
+    if (space->high - tail >= count) {
+        return tail;
+    }
+    return NO_MAPPING;
+}
+
+static struct vma* new_vma(uint64_t start, uint64_t end, uint64_t prot){
+    struct vma* vma = calloc(1, sizeof(*vma));
+    if (vma == NULL) {
+        fprintf(stderr, "Error! Failed to allocate virtual memory area.\n");
+        exit(EXIT_FAILURE);
+    }
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot & PTE_PROT;
+    return vma;
+}
+
+uint64_t vma_map(struct vma_space* space, uint64_t vpn, uint64_t count, uint64_t prot){
+    struct vma* next;
+
+    if (count == 0) {
+        return NO_MAPPING;
+    }
+
+    if (vpn == NO_MAPPING) {
+        vpn = vma_get_unmapped_area(space, count);
+        if (vpn == NO_MAPPING) {
+            return NO_MAPPING;
+        }
+    } else {
+        if (vpn < space->low || vpn >= space->high || space->high - vpn < count) {
+            return NO_MAPPING;
+        }
+        next = vma_find(space, vpn);
+        if (next != NULL && next->start < vpn + count) {
+            return NO_MAPPING;
+        }
+    }
+
+    link_vma(space, new_vma(vpn, vpn + count, prot));
+    return vpn;
+}
+
+static int free_frame(uint64_t vpn, uint64_t* pte, void* arg){
+    (void)vpn;
+    (void)arg;
+    free_page_frame(*pte >> 12);
+    return 0;
+}
+
+// Drops the pages of [start, end) from the page table, freeing what was populated.
+static void depopulate(struct vma_space* space, uint64_t start, uint64_t end){
+    page_table_walk(space->pt, start, end - start, free_frame, NULL);
+    page_table_unmap_range(space->pt, start, end - start);
+}
+
+void vma_unmap(struct vma_space* space, uint64_t vpn, uint64_t count){
+    uint64_t end = count > space->high - vpn ? space->high : vpn + count;
+    struct vma* vma;
+
+    if (count == 0 || vpn >= space->high) {
+        return;
+    }
+
+    while ((vma = vma_find(space, vpn)) != NULL && vma->start < end) {
+        uint64_t cut_start = vma->start > vpn ? vma->start : vpn;
+        uint64_t cut_end = vma->end < end ? vma->end : end;
+
+        depopulate(space, cut_start, cut_end);
+        unlink_vma(space, vma);
+
+        // What is left on either side goes back as areas of its own.
+        if (vma->end > cut_end) {
+            link_vma(space, new_vma(cut_end, vma->end, vma->prot));
+        }
+        if (vma->start < cut_start) {
+            vma->end = cut_start;
+            link_vma(space, vma);
+        } else {
+            free(vma);
+        }
+    }
+}
+
+// Populates a page of an area with a zeroed frame carrying the area's permissions.
+static uint64_t vma_fault(struct pt_fault_handler* handler, uint64_t pt, uint64_t vpn){
+    struct vma_space* space = (struct vma_space*)handler;
+    struct vma* vma = vma_find(space, vpn);
+    uint64_t ppn;
+
+    if (vma == NULL || vma->start > vpn) {
+        return NO_MAPPING;
+    }
+
+    ppn = alloc_page_frame();
+    if (page_table_update_checked(pt, vpn, ppn) != 0) {
+        free_page_frame(ppn); // over the root's limits or out of tables
+        return NO_MAPPING;
+    }
+    page_table_protect_range(pt, vpn, 1, vma->prot);
+    return ppn;
+}
+
+void vma_space_init(struct vma_space* space, uint64_t pt, uint64_t low, uint64_t high){
+    memset(space, 0, sizeof(*space));
+    space->handler.fault = vma_fault;
+    space->pt = pt;
+    space->low = low;
+    space->high = high;
+}
+
+void vma_space_destroy(struct vma_space* space){
+    while (space->root != NULL) {
+        struct vma* vma = space->root;
+
+        depopulate(space, vma->start, vma->end);
+        unlink_vma(space, vma);
+        free(vma);
+    }
+}
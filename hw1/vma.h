@@ -0,0 +1,58 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+
+#include "os.h"
+
+/*
+ * Virtual memory areas on top of a page table, like mm_struct and
+ * vm_area_struct.
+ *
+ * An address space keeps its areas in an AVL tree ordered by start vpn.
+ * Every node holds the free gap before its area and the largest gap in its
+ * subtree, so both vma_find and vma_get_unmapped_area take O(log n).
+ * Mapping an area only reserves address space. Pages are populated with
+ * zeroed frames when they fault through page_table_query_or_fault with the
+ * space's handler, and get the area's prot bits.
+ */
+struct vma {
+	uint64_t start;		/* first vpn */
+	uint64_t end;		/* vpn after the last */
+	uint64_t prot;		/* PTE_PROT bits for its pages */
+
+	struct vma *left, *right;
+	int height;
+	uint64_t gap;		/* free vpns between the previous area and start */
+	uint64_t max_gap;	/* largest gap in this subtree */
+};
+
+struct vma_space {
+	struct pt_fault_handler handler;	/* first, so the handler leads back here */
+	uint64_t pt;
+	uint64_t low, high;	/* areas are placed in [low, high) */
+	struct vma *root;
+	uint64_t count;
+};
+
+void vma_space_init(struct vma_space *space, uint64_t pt, uint64_t low, uint64_t high);
+
+/* Unmap every area, freeing the frames populated in them */
+void vma_space_destroy(struct vma_space *space);
+
+/*
+ * Map count pages at vpn, or wherever they fit if vpn is NO_MAPPING.
+ * Returns the start, or NO_MAPPING if the range is taken or nothing fits.
+ */
+uint64_t vma_map(struct vma_space *space, uint64_t vpn, uint64_t count, uint64_t prot);
+
+/* Unmap a range like munmap, splitting areas that straddle it */
+void vma_unmap(struct vma_space *space, uint64_t vpn, uint64_t count);
+
+/* The first area ending above vpn, which contains vpn if start <= vpn */
+struct vma *vma_find(const struct vma_space *space, uint64_t vpn);
+
+/* Lowest start with count free pages after it, or NO_MAPPING */
+uint64_t vma_get_unmapped_area(const struct vma_space *space, uint64_t count);
+
+#endif
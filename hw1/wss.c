@@ -0,0 +1,169 @@
+#include "os.h"
+#include "wss.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+// Access history of one mapped page, the latest sample in bit 0.
+struct wss_page {
+    uint64_t vpn;
+    uint8_t history;
+};
+
+struct wss_tracker {
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t count;
+    unsigned int window;
+    uint64_t samples;
+    struct wss_page* pages; // sorted by vpn
+    size_t npages;
+};
+
+struct wss_idle {
+    uint64_t first_vpn;
+    uint64_t* bitmap;
+    uint64_t idle;
+};
+
+static int mark_idle(uint64_t vpn, uint64_t* pte, void* arg){
+    uint64_t* marked = arg;
+
+    (void)vpn;
+    *pte &= ~PTE_ACCESSED;
+    (*marked)++;
+    return 0;
+}
+
+uint64_t wss_mark_idle(uint64_t pt, uint64_t vpn, uint64_t count){
+    uint64_t marked = 0;
+
+    page_table_walk(pt, vpn, count, mark_idle, &marked);
+    return marked;
+}
+
+static int read_idle(uint64_t vpn, uint64_t* pte, void* arg){
+    struct wss_idle* idle = arg;
+    uint64_t bit = vpn - idle->first_vpn;
+
+    if ((*pte & PTE_ACCESSED) == 0) {
+        idle->bitmap[bit / 64] |= 1ULL << (bit % 64);
+        idle->idle++;
+    }
+    return 0;
+}
+
+uint64_t wss_read_idle(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t* bitmap){
+    struct wss_idle idle = {vpn, bitmap, 0};
+
+    for (uint64_t i = 0; i < (count + 63) / 64; i++) {
+        bitmap[i] = 0;
+    }
+    page_table_walk(pt, vpn, count, read_idle, &idle);
+    return idle.idle;
+}
+
+struct wss_tracker* wss_create(uint64_t pt, uint64_t vpn, uint64_t count, unsigned int window){
+    struct wss_tracker* tracker;
+
+    if (window == 0 || window > WSS_MAX_WINDOW) {
+        fprintf(stderr, "Error! Working set window must be 1 to %d samples.\n", WSS_MAX_WINDOW);
+        exit(EXIT_FAILURE);
+    }
+
+    tracker = calloc(1, sizeof(*tracker));
+    if (tracker == NULL) {
+        fprintf(stderr, "Error! Failed to allocate working set tracker.\n");
+        exit(EXIT_FAILURE);
+    }
+    tracker->pt = pt;
+    tracker->vpn = vpn;
+    tracker->count = count;
+    tracker->window = window;
+
+    // Start from a clean slate so the first sample only sees accesses made after this.
+    wss_mark_idle(pt, vpn, count);
+    return tracker;
+}
+
+struct wss_merge {
+    struct wss_tracker* tracker;
+    const struct wss_page* old; // the previous sample's pages
+    size_t old_count;
+    size_t old_next;
+    struct wss_page* pages;
+    size_t npages;
+    size_t capacity;
+};
+
+// Both the walk and the previous sample are in vpn order, so histories carry over with a
+// single merge. Pages unmapped since the last sample drop out.
+static int sample_page(uint64_t vpn, uint64_t* pte, void* arg){
+    struct wss_merge* merge = arg;
+    uint8_t history = 0;
+
+    while (merge->old_next < merge->old_count && merge->old[merge->old_next].vpn < vpn) {
+        merge->old_next++;
+    }
+    if (merge->old_next < merge->old_count && merge->old[merge->old_next].vpn == vpn) {
+        history = merge->old[merge->old_next].history;
+    }
+
+    history = (uint8_t)((history << 1) | ((*pte & PTE_ACCESSED) != 0));
+    history &= (uint8_t)((1U << merge->tracker->window) - 1);
+    *pte &= ~PTE_ACCESSED;
+
+    if (merge->npages == merge->capacity) {
+        merge->capacity = merge->capacity ? merge->capacity * 2 : 64;
+        merge->pages = realloc(merge->pages, merge->capacity * sizeof(*merge->pages));
+        if (merge->pages == NULL) {
+            fprintf(stderr, "Error! Failed to allocate working set pages.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    merge->pages[merge->npages].vpn = vpn;
+    merge->pages[merge->npages].history = history;
+    merge->npages++;
+    return 0;
+}
+
+void wss_sample(struct wss_tracker* tracker){
+    struct wss_merge merge = {tracker, tracker->pages, tracker->npages, 0, NULL, 0, 0};
+
+    page_table_walk(tracker->pt, tracker->vpn, tracker->count, sample_page, &merge);
+
+    free(tracker->pages);
+    tracker->pages = merge.pages;
+    tracker->npages = merge.npages;
+    tracker->samples++;
+}
+
+void wss_report(const struct wss_tracker* tracker, struct wss_report* report){
+    *report = (struct wss_report){0};
+    report->samples = tracker->samples;
+
+    for (size_t i = 0; i < tracker->npages; i++) {
+        uint8_t history = tracker->pages[i].history;
+        unsigned int age = 0;
+
+        if (history == 0) {
+            report->age[tracker->window]++;
+            report->cold++;
+            continue;
+        }
+
+        while ((history & (1U << age)) == 0) {
+            age++;
+        }
+        report->age[age]++;
+        if (age == 0) {
+            report->hot++;
+        } else {
+            report->warm++;
+        }
+    }
+}
+
+void wss_destroy(struct wss_tracker* tracker){
+    free(tracker->pages);
+    free(tracker);
+}
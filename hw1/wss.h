@@ -0,0 +1,54 @@
+#ifndef WSS_H
+#define WSS_H
+
+#include <stdint.h>
+
+/*
+ * Working-set size estimation from the PTE_ACCESSED bit.
+ *
+ * The software MMU in vm.c sets PTE_ACCESSED when it fills a TLB entry or
+ * copies through a page, as hardware does on a page walk. Like Linux idle
+ * page tracking, marking a page idle clears the bit, and a page still
+ * clear later was not touched in between. TLB hits do not set the bit, so
+ * flush the vm TLB whenever pages are marked idle.
+ */
+
+/* Clear PTE_ACCESSED on every mapped page in the range; returns pages marked */
+uint64_t wss_mark_idle(uint64_t pt, uint64_t vpn, uint64_t count);
+
+/*
+ * Set bit i of bitmap (64 pages per word) if vpn + i is mapped and idle.
+ * The bitmap must hold count bits; returns the number of idle pages.
+ */
+uint64_t wss_read_idle(uint64_t pt, uint64_t vpn, uint64_t count, uint64_t *bitmap);
+
+/*
+ * A tracker samples a range of one root at intervals chosen by the caller.
+ * Each sample records which pages were accessed since the previous one and
+ * marks them idle again. The last window samples classify the pages:
+ *
+ *   hot   accessed since the latest sample
+ *   warm  accessed earlier within the window
+ *   cold  not accessed within the window
+ *
+ * age[i] counts pages last accessed i samples ago, and age[window] the cold
+ * ones. The working set is hot + warm.
+ */
+#define WSS_MAX_WINDOW	8
+
+struct wss_tracker;
+
+struct wss_report {
+	uint64_t samples;
+	uint64_t hot;
+	uint64_t warm;
+	uint64_t cold;
+	uint64_t age[WSS_MAX_WINDOW + 1];
+};
+
+struct wss_tracker *wss_create(uint64_t pt, uint64_t vpn, uint64_t count, unsigned int window);
+void wss_sample(struct wss_tracker *tracker);
+void wss_report(const struct wss_tracker *tracker, struct wss_report *report);
+void wss_destroy(struct wss_tracker *tracker);
+
+#endif